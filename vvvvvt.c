@@ -9,22 +9,41 @@
 #include <X11/Xutil.h>
 #include <X11/cursorfont.h>
 #include <X11/keysym.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <locale.h>
+#include <poll.h>
+#include <pthread.h>
 #include <pty.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
-#include <sys/select.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
 
 // Config
 #define LINE_SIZE 256
-#define HIST_SIZE 2048
+#define MAX_ROWS 1024
+#define BATCH_SIZE 4096
+#define ECHO_DELAY 100000000 // how long after a keypress output is drawn right away (in ns)
+#define PARSE_SLICE 4096     // bytes parsed between two checks for X input
+#define OUT_MAX (1 << 20)    // most bytes queued for the pty (see pty_write())
+#define PASTE_CHUNK 4096     // pasted bytes queued for the pty at once (see paste_feed())
+#define PASTE_TIMEOUT 2000000000 // how long the owner of a selection may keep a paste waiting (in ns)
+#define SYNC_TIMEOUT 150000000 // longest time frames are held back by a synchronized update (in ns)
+#define COLD_BLOCK 65536     // bytes of compressed lines allocated at once (see cold_alloc())
 
 // Macros
 #define BETWEEN(x, a, b)    ((a) <= (x) && (x) <= (b))
@@ -37,7 +56,8 @@
 #define IS_DELIM(c)         (strchr(" <>()[]{}'`\"", *(c)))
 #define POINT_EQ(a, b)      ((a).x == (b).x && (a).y == (b).y)
 #define POINT_LT(a, b)      ((a).y < (b).y || ((a).y == (b).y && (a).x < (b).x))
-#define LINE(y)             (term.hist[((y) + term.scroll) % HIST_SIZE])
+#define LINE(y)             (get_line((y) + vt->term.scroll))
+#define EDIT_LINE(y)        (sel_touch(y), edit_line((y) + vt->term.scroll))
 
 #define ESC '\033'
 #define CSI "\033["
@@ -66,8 +86,28 @@ enum {
 	ATTR_BAR        = 1 << 10,
 	ATTR_GUARDED    = 1 << 11,
 	ATTR_DIRTY      = 1 << 12,
+	ATTR_INVALID    = 1 << 13, // not valid UTF-8, rendered as ⁇
 };
 
+// States of the escape sequence parser (see https://vt100.net/emu/dec_ansi_parser)
+enum { GROUND, ESCAPE, ESCAPE_INTER, CSI_ENTRY, CSI_PARAM, CSI_INTER, STRING };
+
+// Classes of input bytes, as seen by the parser
+enum {
+	CLASS_C0,       // control characters
+	CLASS_CANCEL,   // CAN and SUB abort the current sequence
+	CLASS_ESC,
+	CLASS_INTER,    // intermediate bytes (space to slash)
+	CLASS_PARAM,    // digits, colon and semicolon
+	CLASS_PRIVATE,  // private markers (< = > ?)
+	CLASS_FINAL,    // @ to ~
+	CLASS_DEL,
+	CLASS_HIGH,     // anything >= 0x80 (UTF-8)
+};
+
+// States of the UTF-8 decoder (see `utf8_dfa`)
+enum { UTF8_ACCEPT = 0, UTF8_REJECT = 12 };
+
 typedef struct {
 	u8 u[4];   // raw UTF-8 bytes
 	u16 attr;  // bitmask of ATTR_* flags
@@ -80,71 +120,316 @@ typedef struct {
 	int y;
 } Point;
 
-static struct timespec monotime, timeout;
+// A call to move_lines(), replayed on the back buffer by the renderer
+typedef struct {
+	int start, end, diff;
+} Move;
 
-// State affected by Save Cursor / Restore Cursor
-static struct {
-	Rune rune;          // current char attributes
-	int x, y;           // cursor position
-} cursor, saved_cursors[2];
+// A run of cells with the same attributes, in a compressed line
+typedef struct {
+	u16 len;   // number of cells
+	u16 attr;
+	u8 fg;
+	u8 bg;
+} Span;
+
+// A line of the history that scrolled past the top of the screen, stored compactly:
+// its attributes as runs of cells, followed by its text (see `compress_line`)
+typedef struct {
+	u32 offset;        // position in the block it was allocated from
+	u16 num_spans;
+	int: 16;
+	Span spans[];
+} ColdLine;
+
+// Compressed lines are allocated one after the other from large blocks, since they are mostly
+// freed in the order they were allocated. A block is freed along with its last line.
+typedef struct {
+	u32 live;          // lines allocated from the block and not freed yet (+1 while it is in use)
+	u32 used;          // bytes of `data` allocated so far
+	char data[];
+} ColdBlock;
 
-static struct {
-	u64 snap;    // snapping mode
-	Point mark;  // coordinates of the point clicked to start the selection
-	Point start; // coordinates of the beginning of the selection (inclusive)
-	Point end;   // coordinates of the end of the selection (exclusive)
-	u64 hash;    // hash of the contents of the selection
-} sel;
+// Frame scheduling modes
+enum { IDLE, LATENCY, THROUGHPUT };
 
+// Performance counters of the main loop and the renderer (see dump_stats())
+static struct {
+	u64 frames;        // frames drawn
+	u64 cells;         // cells redrawn
+	u64 max_cells;     // most cells redrawn by a single frame
+	u64 draw_calls;    // calls to draw_text()
+	u64 parse_time;    // time spent parsing (in ns)
+	u64 draw_time;     // time spent preparing and rendering frames
+	u64 wait_time;     // time spent waiting for events
+} perf;
+
+// Startup timings, reported along with the first frame
 static struct {
-	char buf[BUFSIZ]; // input buffer
-	char *c;          // current reading position (points inside `buf`)
-	char *end;        // one past the last valid char (points inside `buf`)
-	int fd;           // file descriptor of the master pty
-	int rows, cols;   // size of the pty (in characters)
+	u64 start;         // when main() was entered, or when the server received the request
+	u64 connected;     // when the connection to the X server was established
+	u64 configured;    // when the resources were loaded
+	u64 fonts;         // time spent opening fonts
+	u64 spawned;       // when the command was started
+} startup;
+
+// With THREADS, the pty is parsed on its own thread. Everything the parser touches
+// (the terminal, the scheduler) is shared with the main loop, and guarded by a lock.
+#ifdef THREADS
+static pthread_mutex_t term_lock = PTHREAD_MUTEX_INITIALIZER;
+static int lock_waiters; // threads blocked in LOCK()
+#define LOCK()   do { __atomic_add_fetch(&lock_waiters, 1, __ATOMIC_SEQ_CST); \
+                      pthread_mutex_lock(&term_lock); \
+                      __atomic_sub_fetch(&lock_waiters, 1, __ATOMIC_SEQ_CST); } while (0)
+#define UNLOCK() pthread_mutex_unlock(&term_lock)
+#else
+#define LOCK()
+#define UNLOCK()
+#endif
+
+// A terminal instance: the state of the emulator core. The core works on the instance `vt` points
+// to; the API (term_new(), term_feed()…) takes the instance explicitly, and leaves `vt` alone.
+typedef struct {
+	// Performance counters (see dump_stats())
+	struct {
+		u64 reads;        // reads from the pty that returned data
+		u64 full_reads;   // reads that filled the whole buffer
+		u64 bytes;        // bytes received from the pty (or term_feed())
+		u64 controls;     // control chars executed
+		u64 strings;      // OSC, DCS, SOS, PM and APC strings (ignored)
+		u64 cells;        // cells written by the parser
+		u64 escapes[128]; // escape sequences other than CSI, by final byte
+		u64 csis[128];    // CSI sequences, by final byte
+	} stats;
+
+	// State affected by Save Cursor / Restore Cursor
+	struct {
+		Rune rune;          // current char attributes
+		int x, y;           // cursor position
+	} cursor, saved_cursors[2];
+
+	// Selection
+	struct {
+		u64 snap;    // snapping mode
+		Point mark;  // coordinates of the point clicked to start the selection
+		Point start; // coordinates of the beginning of the selection (inclusive)
+		Point end;   // coordinates of the end of the selection (exclusive)
+		char *text;  // copy of the text of the selection, made when it was cleared while PRIMARY
+		size_t text_len;
+		bool primary; // the selection is PRIMARY, which is read from the screen when requested
+		int: 32;
+	} sel;
+
+	// Input from the pty
+	struct {
+		char buf[BUFSIZ]; // input buffer
+		const char *c;    // current reading position (points inside `buf`)
+		const char *end;  // one past the last valid char (points inside `buf`)
+		int fd;           // file descriptor of the master pty
+		int rows, cols;   // size of the pty (in characters)
+		int wake[2];      // pipe the parser thread closes once it stopped
+		u32 events;       // epoll events received since the pty was last drained
+	} pty;
+
+	// Output to the pty (keypresses, replies…), written whenever the pty accepts it
+	struct {
+		char *buf;        // ring buffer of bytes waiting to be written (NULL until needed)
+		int size;         // allocated size of `buf` (a power of two)
+		int start;        // position of the first waiting byte
+		int len;          // number of waiting bytes
+		int fd;           // where to write it (-1 to drop it)
+	} out;
+
+	// Screen, history and modes
+	struct {
+		Rune **hist;                     // ring buffer of the lines starting from `frozen` (NULL if blank)
+		Rune *spare;                     // list of unused lines, linked through their first bytes
+		bool *damage;                    // which lines of `hist` changed since the last frame
+		ColdLine **cold;                 // ring buffer of the compressed lines before `frozen`
+		ColdBlock *cold_block;           // block new compressed lines are allocated from
+		struct { int n; Rune line[LINE_SIZE]; } *thawed; // lines of `cold` recently expanded
+		int hist_size;                   // number of lines allocated in `hist` (a power of two)
+		int cold_size;                   // number of lines allocated in `cold` (a power of two)
+		int frozen;                      // first line that isn’t compressed
+		int hist_start;                  // first line kept in the history
+		int save_lines;                  // maximum number of lines kept above the screen
+		Move moves[16];                  // calls to move_lines() since the last frame
+		int num_moves;
+		bool tabs[LINE_SIZE];            // tab stops
+		int scroll;                      // scroll position (line number of the top of the viewport)
+		int lines;                       // line number of the top of the screen
+		int top;                         // top scroll limit
+		int bot;                         // bottom scroll limit
+		int cursor_style;                // appearance of the cursor
+		u8 charsets[4];                  // designated character sets (see ISO/IEC 2022)
+		int charset;                     // invoked character set (index inside `charsets`)
+		bool alt;                        // use the alternate screen buffer?
+		bool hide;                       // hide the cursor?
+		bool reverse_video;              // use a dark background?
+		bool report_buttons;             // report clicks/scrolls to the application?
+		bool report_motion;              // report mouse motions to the application?
+		bool report_focus;               // report focus in/out events to the application?
+		bool bracketed_paste;            // send escape sequences before/after each paste?
+		bool app_keys;                   // send different escape sequences for arrow keys?
+		bool meta_sends_escape;          // send an ESC char when a key is pressed with meta held?
+		bool bold_as_bright;             // use bright (8–15) colors for bold characters
+		bool guarded;
+		u8 utf8_state;                   // state of the UTF-8 decoder for the last rune printed
+		u8 utf8_len;                     // number of bytes of the last rune received so far
+		int: 16;
+		int: 32;
+		u64 sync_until;                  // hold frames back until then (0 unless in a synchronized update)
+	} term;
+
+	// Escape sequence parser, resumable at any byte
+	struct {
+		int state;          // one of GROUND, ESCAPE…
+		int num_args;       // number of separators seen so far in a CSI sequence
+		int arg[32];        // numeric arguments of a CSI sequence
+		u16 extra;          // private marker and/or intermediate byte of a CSI sequence
+		u8 second_byte;     // byte following ESC
+		int: 8;
+	} parser;
 	int: 32;
-} pty;
+} Terminal;
 
+static __thread Terminal *vt; // per thread, so that the parser threads can work on their own instance
+
+// Event loop: file descriptors watched with epoll, and what to do when they are ready
 static struct {
-	Rune hist[HIST_SIZE][LINE_SIZE]; // history ring buffer
-	bool tabs[LINE_SIZE];            // tab stops
-	int scroll;                      // scroll position (index inside `hist`)
-	int lines;                       // last line printed (index inside `hist`)
-	int top;                         // top scroll limit
-	int bot;                         // bottom scroll limit
-	int cursor_style;                // appearance of the cursor
-	u8 charsets[4];                  // designated character sets (see ISO/IEC 2022)
-	int charset;                     // invoked character set (index inside `charsets`)
-	bool alt;                        // use the alternate screen buffer?
-	bool hide;                       // hide the cursor?
-	bool reverse_video;              // use a dark background?
-	bool report_buttons;             // report clicks/scrolls to the application?
-	bool report_motion;              // report mouse motions to the application?
-	bool report_focus;               // report focus in/out events to the application?
-	bool bracketed_paste;            // send escape sequences before/after each paste?
-	bool app_keys;                   // send different escape sequences for arrow keys?
-	bool meta_sends_escape;          // send an ESC char when a key is pressed with meta held?
-	bool bold_as_bright;             // use bright (8–15) colors for bold characters
-	bool guarded;
-} term;
-
-// Drawing context
+	int fd;                        // epoll instance
+	int signals;                   // signalfd receiving SIGUSR1
+	int server;                    // socket the server accepts clients on (see serve())
+	int client;                    // connection the current request is read from (-1 if none)
+	FILE *request;                 // stream collecting the current request…
+	char *request_data;            // …into this buffer
+	size_t request_len;
+	struct {
+		void (*handler)(u32);      // called with the epoll events of `fd` (NULL for a free slot)
+		struct View *view;         // window selected while it runs (NULL for the shared fds)
+		int fd;
+		int: 32;
+	} watches[256];
+} loop;
+
+// Drawing context shared by all windows
 static struct {
 	Display *disp;
 	XftFont *font[4];
-	XftDraw *draw;
 	XftColor colors[256];
-	Window parent;
-	Window win;
+	unsigned long border_color; // pixel value of the borderColor resource
+	Cursor cursor;
 	int screen;
-	bool dirty;
 	int font_height, font_width;
 	int border;
-	bool focused;
+	bool serving;               // in server mode? (then the last window closing doesn't exit)
+	int: 32;
 } w;
 
+// Drawing requests of the current frame, sent in a few big batches by flush_batch()
+static struct {
+	XftGlyphFontSpec glyphs[BATCH_SIZE];
+	XRectangle rects[2][BATCH_SIZE];    // backgrounds, then decorations
+	u16 glyph_colors[BATCH_SIZE];       // palette index, +256 for faint colors
+	u16 rect_colors[2][BATCH_SIZE];
+	int num_glyphs;
+	int num_rects[2];
+	int: 32;
+} batch;
+
+// Glyphs already looked up, indexed by a hash of their UTF-8 bytes and font
+static struct {
+	u32 c;
+	int font;
+	FT_UInt glyph;
+} glyph_cache[4096];
+
 // X atoms
-static Atom XA_DELETE_WINDOW;
+static Atom XA_DELETE_WINDOW, XA_CLIPBOARD, XA_UTF8_STRING, XA_INCR, XA_PASTE, XA_TARGETS;
+
+// Selections we own, and the INCR transfer of one of them in progress
+static struct {
+	char *clipboard;       // text of CLIPBOARD, copied from the selection by copy() (PRIMARY is
+	size_t clipboard_len;  // read from the terminal of its owner, see owned_text())
+	Window owner[2];       // which of our windows own PRIMARY and CLIPBOARD
+	size_t chunk;          // largest property we write at once
+	char *data;            // text being transferred (NULL if none)
+	size_t len;            // length of `data`
+	size_t pos;            // bytes of `data` already sent
+	Window requestor;      // window receiving the transfer
+	Atom property;         // property of `requestor` to write the chunks to
+	Atom type;             // UTF8_STRING or STRING
+} owned;
+
+// A window, and the terminal it shows. In server mode there is one per client, all sharing the
+// X connection, the fonts and the palette in `w`.
+typedef struct View {
+	Terminal *vt;
+	struct View *next;          // next window of `views`
+	Window parent;
+	Window win;
+	Pixmap buf;                 // back buffer, copied to `win` once a frame is complete
+	GC gc;
+	XftDraw *draw;
+	int buf_width, buf_height;
+	bool dirty;
+	bool focused;
+	bool closed;                // closed by the user or the application (freed by run())
+	int status;                 // exit status, if this is the last window to close
+	int timer;                  // timerfd armed at `frame.deadline`
+	Point pointer;              // cell the mouse was last seen over
+#ifdef THREADS
+	bool closing;               // is the parser thread asked to stop?
+	pthread_t thread;           // parser thread
+#else
+	int: 32;
+#endif
+
+	// Frame scheduler, and contents of the next frame
+	struct {
+		u64 interval;      // minimum time between frames under load (in ns)
+		u64 deadline;      // when to draw the next frame, unless `mode` is IDLE
+		u64 last_draw;     // when the last frame was drawn
+		u64 last_key;      // when the last key was pressed
+		u64 parse_time;    // time spent parsing since the last frame
+		u64 bytes;         // number of bytes parsed since the last frame
+		int mode;          // IDLE, LATENCY or THROUGHPUT
+		bool show_timings; // print the timings of each frame to stderr?
+		bool held;         // is a due frame held back by a synchronized update?
+		int rows, cols;    // size of the frame (in characters)
+		int scroll;        // number of rows to scroll the back buffer by
+		int num_moves;
+		Move moves[16];    // region scrolls to apply to the back buffer, after `scroll`
+		int max_rows;      // number of rows allocated in `runes`
+		bool redraw[MAX_ROWS];                 // rows with cells to redraw
+		Rune (*runes)[LINE_SIZE];              // cells as they should appear on screen
+	} frame;
+
+	// Selection being pasted, see paste()
+	struct {
+		char *text;     // text to send to the pty, with newlines as carriage returns (NULL if none)
+		size_t len;     // length of `text`
+		size_t pos;     // bytes of `text` already queued for the pty
+		Atom selection; // selection being received (None once it has arrived)
+		Atom target;    // UTF8_STRING, or STRING if its owner doesn't support it
+		Atom next;      // selection to paste once this one is complete (None if none)
+		bool incr;      // still receiving chunks of an INCR transfer?
+		bool bracketed; // send the bracketed paste markers around it?
+		u64 heard;      // when the owner of `selection` last answered (or was asked)
+	} pasting;
+
+	// What the last frame showed, see prepare_frame()
+	struct {
+		int scroll;
+		Point sel_start, sel_end; // line numbers are absolute
+		int cursor_y;
+		bool reverse_video;
+	} shown;
+	int: 32;
+} View;
+
+static __thread View *view; // window the main loop or the parser thread is working on
+static View *views;         // all the windows, most recent first
 
 static const u8 charsets[][380] = {
 	"  ! \" # $ % & ' ( ) * + , - . / 0 1 2 3 4 5 6 7 8 9 : ; < = > ? @ A B C D E F G H I J K L M N O "
@@ -155,6 +440,31 @@ static const u8 charsets[][380] = {
 	"Ð Ñ Ò Ó Ô Õ Ö × Ø Ù Ú Û Ü Ý Þ ß à á â ã ä å æ ç è é ê ë ì í î ï ð ñ ò ó ô õ ö ÷ ø ù ú û ü ý þ ",
 };
 
+static const u8 byte_class[256] = {
+	[0x18] = CLASS_CANCEL, [0x1A] = CLASS_CANCEL, [0x1B] = CLASS_ESC,
+	[' ' ... '/'] = CLASS_INTER, ['0' ... ';'] = CLASS_PARAM, ['<' ... '?'] = CLASS_PRIVATE,
+	['@' ... '~'] = CLASS_FINAL, [0x7F] = CLASS_DEL, [0x80 ... 0xFF] = CLASS_HIGH,
+};
+
+// Björn Höhrmann’s UTF-8 DFA (http://bjoern.hoehrmann.de/utf-8/decoder/dfa/)
+// The first 256 entries map bytes to classes, the rest map state + class to a new state
+static const u8 utf8_dfa[] = {
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+	7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
+	8,8,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,
+	10,3,3,3,3,3,3,3,3,3,3,3,3,4,3,3,11,6,6,6,5,8,8,8,8,8,8,8,8,8,8,8,
+
+	0,12,24,36,60,96,84,12,12,12,48,72,12,12,12,12,12,12,12,12,12,12,12,12,
+	12,0,12,12,12,12,12,0,12,0,12,12,12,24,12,12,12,12,12,24,12,24,12,12,
+	12,12,12,12,12,12,12,24,12,12,12,12,12,24,12,12,12,12,12,12,12,24,12,12,
+	12,12,12,12,12,12,12,36,12,36,12,12,12,36,12,12,12,12,12,36,12,36,12,12,
+	12,36,12,12,12,12,12,12,12,12,12,12,
+};
+
 // Number of bytes in an UTF-8 sequence starting with byte `c`
 static u32 utf_len(u8 c)
 {
@@ -162,40 +472,547 @@ static u32 utf_len(u8 c)
 	return c < 0xC0 ? 1 : c < 0xE0 ? 2 : c < 0xF0 ? 3 : lookup[c & 0x0F];
 }
 
+// Length of the run of printable ASCII chars at the start of `p`, checking 8 bytes at a time
+static long ascii_run(const u8 *p, const u8 *end)
+{
+	const u8 *start = p;
+
+	for (u64 x; end - p >= 8; p += 8) {
+		// A byte gets its high bit set in the mask iff it is < 0x20, 0x7F or >= 0x80
+		// (carries and borrows can only flag bytes that come after a flagged one)
+		memcpy(&x, p, 8);
+		if (((x - 0x2020202020202020) | (x + 0x0101010101010101) | x) & 0x8080808080808080)
+			break;
+	}
+
+	while (p < end && BETWEEN(*p, ' ', '~'))
+		++p;
+	return p - start;
+}
+
+// Exit after a failed syscall
+static void __attribute__((noreturn)) die(const char* message)
+{
+	perror(message);
+	exit(1);
+}
+
+// Current time of the monotonic clock, in nanoseconds
+static u64 now(void)
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (u64) time.tv_sec * 1000000000 + (u64) time.tv_nsec;
+}
+
+// With TRACE, spans of time are recorded in a ring buffer, and SIGUSR1 writes them out in the
+// Chrome trace format (open it in chrome://tracing or ui.perfetto.dev). Without it, TRACE_SPAN()
+// compiles to nothing. The parser thread only records spans under the lock, which write_trace()
+// holds too, so that it never reads a span half written.
+#ifdef TRACE
+static struct {
+	struct {
+		const char *name;
+		u64 start, end;
+		int thread;        // 0 for the main loop, 1 for the parser thread
+		int: 32;
+	} spans[1 << 16];
+	u64 count;             // number of spans recorded so far (only the last LEN(spans) are kept)
+} trace;
+static __thread int trace_thread;
+
+// Record a span named `name`, from `start` to `end`
+static void trace_span(const char *name, u64 start, u64 end)
+{
+	u64 i = __atomic_fetch_add(&trace.count, 1, __ATOMIC_RELAXED) & (LEN(trace.spans) - 1);
+	trace.spans[i] = (__typeof(*trace.spans)) { name, start, end, trace_thread };
+}
+
+#define TRACE_NOW()             now()
+#define TRACE_SPAN(name, start) trace_span(name, start, now())
+#else
+#define TRACE_NOW()             0
+#define TRACE_SPAN(name, start) (void) (start)
+#endif
+
+// Only the parser thread records spans that ended earlier (see parse_loop())
+#if defined(TRACE) && defined(THREADS)
+#define TRACE_SPAN_UNTIL(name, start, end) trace_span(name, start, end)
+#elif defined(THREADS)
+#define TRACE_SPAN_UNTIL(name, start, end) ((void) (start), (void) (end))
+#endif
+
+// Smallest power of two greater than or equal to `n`
+static int pow2(int n)
+{
+	return n > 1 ? 1 << (32 - __builtin_clz((u32) n - 1)) : 1;
+}
+
+// Queue `len` bytes of output to the pty. If the application stopped reading its input, the
+// output is dropped once OUT_MAX bytes are waiting, rather than queued without bound.
+static void pty_write(const char *data, int len)
+{
+	if (vt->out.len + len > OUT_MAX)
+		return;
+
+	// Grow the ring as needed, unwrapping its contents
+	if (vt->out.len + len > vt->out.size) {
+		int size = pow2(MAX(vt->out.len + len, 4096));
+		char *buf = malloc((size_t) size);
+		if (!buf)
+			die("Couldn't queue output");
+		if (vt->out.len) {
+			int first = MIN(vt->out.len, vt->out.size - vt->out.start);
+			memcpy(buf, vt->out.buf + vt->out.start, (size_t) first);
+			memcpy(buf + first, vt->out.buf, (size_t) (vt->out.len - first));
+		}
+		free(vt->out.buf);
+		vt->out.buf = buf;
+		vt->out.size = size;
+		vt->out.start = 0;
+	}
+
+	int end = (vt->out.start + vt->out.len) & (vt->out.size - 1);
+	int first = MIN(len, vt->out.size - end);
+	memcpy(vt->out.buf + end, data, (size_t) first);
+	memcpy(vt->out.buf, data + first, (size_t) (len - first));
+	vt->out.len += len;
+}
+
+// Queue formatted output to the pty
+static void __attribute__((format(printf, 1, 2))) pty_printf(const char *format, ...)
+{
+	char buf[64];
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(buf, sizeof(buf), format, args);
+	va_end(args);
+	pty_write(buf, MIN(len, (int) sizeof(buf) - 1));
+}
+
+// Write as much of the queued output as the pty accepts without blocking
+static void pty_flush(void)
+{
+	if (vt->out.fd < 0)
+		vt->out.len = 0;
+	while (vt->out.len) {
+		long result = write(vt->out.fd, vt->out.buf + vt->out.start, (size_t) MIN(vt->out.len, vt->out.size - vt->out.start));
+		if (result <= 0)
+			return; // the event loop tries again once the pty is writable
+		vt->out.start = (vt->out.start + (int) result) & (vt->out.size - 1);
+		vt->out.len -= (int) result;
+	}
+}
+
+// Bitwise OR of the `n` cells from `rune`: zero if they are all blank
+static u64 rune_bits(const Rune *rune, int n)
+{
+	u64 bits = 0;
+	for (int i = 0; i < n; ++i) {
+		u64 cell;
+		memcpy(&cell, rune + i, sizeof(cell));
+		bits |= cell;
+	}
+	return bits;
+}
+
+// Release a reference to `block`, freeing it with the last one
+static void cold_release(ColdBlock *block)
+{
+	if (block && !--block->live)
+		free(block);
+}
+
+// Allocate `size` bytes for a compressed line from the current block, starting a new one if
+// it is full. This is cheaper than a malloc() per line that scrolls off.
+static ColdLine *cold_alloc(size_t size)
+{
+	size = (size + 3) & ~(size_t) 3; // the next line needs to be aligned too
+	ColdBlock *block = vt->term.cold_block;
+	if (!block || block->used + size > COLD_BLOCK) {
+		cold_release(block);
+		if (!(block = malloc(sizeof(ColdBlock) + COLD_BLOCK)))
+			die("Couldn't compress the history");
+		*block = (ColdBlock) { 1, 0 };
+		vt->term.cold_block = block;
+	}
+
+	ColdLine *line = (ColdLine*) (void*) (block->data + block->used);
+	line->offset = (u32) ((char*) line - (char*) block);
+	block->used += (u32) size;
+	++block->live;
+	return line;
+}
+
+// Free the compressed line `line` (if not NULL)
+static void cold_free(ColdLine *line)
+{
+	if (line)
+		cold_release((ColdBlock*) (void*) ((char*) line - line->offset));
+}
+
+// Compress `line` (see `ColdLine`): spans of attributes, then the text of each cell, where
+// 0xFF escapes cells that aren’t valid UTF-8 (followed by their length)
+static ColdLine *compress_line(const Rune *line)
+{
+	Span spans[LINE_SIZE];
+	u8 text[6 * LINE_SIZE + 4]; // room for copying 4 bytes at a time
+	int num_spans = 0;
+	long len = 0;
+
+	// Skip the blank cells at the end, 32 at a time, then 4, then 1
+	int num_cells = LINE_SIZE;
+	while (num_cells >= 32 && !rune_bits(line + num_cells - 32, 32))
+		num_cells -= 32;
+	while (num_cells >= 4 && !rune_bits(line + num_cells - 4, 4))
+		num_cells -= 4;
+	while (num_cells && !rune_bits(line + num_cells - 1, 1))
+		--num_cells;
+
+	u32 attrs = 0, prev = 0;
+	for (const Rune *rune = line; rune < line + num_cells; ++rune) {
+		memcpy(&attrs, &rune->attr, sizeof(attrs)); // attr, fg and bg at once
+		if (!num_spans || attrs != prev)
+			spans[num_spans++] = (Span) { 0, rune->attr, rune->fg, rune->bg };
+		++spans[num_spans - 1].len;
+		prev = attrs;
+
+		if (rune->u[0] < 0x80) {
+			text[len++] = rune->u[0];
+			continue;
+		}
+		u32 n = utf_len(rune->u[0]);
+		if (n - 1 > 3 || (n < 4 && rune->u[n]) || !rune->u[n - 1]) {
+			n = (u32) strnlen((const char*) rune->u, 4);
+			text[len++] = 0xFF;
+			text[len++] = (u8) n;
+		}
+		memcpy(text + len, rune->u, 4); // a constant size is cheaper, the extra bytes are overwritten
+		len += n;
+	}
+
+	size_t spans_size = sizeof(Span) * (size_t) num_spans;
+	ColdLine *cold = cold_alloc(sizeof(ColdLine) + spans_size + (size_t) len);
+	cold->num_spans = (u16) num_spans;
+	memcpy(cold->spans, spans, spans_size);
+	memcpy(cold->spans + num_spans, text, (size_t) len);
+	return cold;
+}
+
+// Expand the compressed line `cold` (or a blank line if it’s NULL) into `line`
+static void expand_line(const ColdLine *cold, Rune *line)
+{
+	memset(line, 0, sizeof(Rune[LINE_SIZE]));
+	if (!cold)
+		return;
+
+	const u8 *text = (const u8*) (cold->spans + cold->num_spans);
+	Rune *rune = line;
+
+	for (const Span *span = cold->spans; span < cold->spans + cold->num_spans; ++span) {
+		for (Rune *end = rune + span->len; rune < end; ++rune) {
+			u32 n = *text == 0xFF ? (text += 2)[-1] : *text < 0x80 ? 1 : utf_len(*text);
+			memcpy(rune->u, text, n);
+			text += n;
+			rune->attr = span->attr;
+			rune->fg = span->fg;
+			rune->bg = span->bg;
+		}
+	}
+}
+
+// Expand compressed line number `n` into a small direct-mapped cache
+static const Rune *thaw_line(int n)
+{
+	int size = vt->term.hist_size / 2;
+	if (!vt->term.thawed) {
+		if (!(vt->term.thawed = malloc(sizeof(*vt->term.thawed) * (size_t) size)))
+			die("Couldn't expand the history");
+		for (int i = 0; i < size; ++i)
+			vt->term.thawed[i].n = -1;
+	}
+
+	__typeof(vt->term.thawed) thawed = &vt->term.thawed[n & (size - 1)];
+	if (thawed->n != n) {
+		expand_line(n >= vt->term.hist_start ? vt->term.cold[n & (vt->term.cold_size - 1)] : NULL, thawed->line);
+		thawed->n = n;
+	}
+	return thawed->line;
+}
+
+// Get line number `n` for reading, expanding it if it was compressed
+static inline const Rune *get_line(int n)
+{
+	static const Rune blank[LINE_SIZE];
+	if (n < vt->term.frozen)
+		return thaw_line(n);
+	const Rune *line = vt->term.hist[n & (vt->term.hist_size - 1)];
+	return line ? line : blank;
+}
+
+// Copy the selected text to `text` (unless it's NULL), with rows separated by newlines, and
+// return its length
+static size_t sel_copy(char *text)
+{
+	size_t len = 0;
+	// The last row only counts if the selection covers some of it
+	for (int y = vt->sel.start.y; y < vt->sel.end.y + (vt->sel.end.x > 0); ++y) {
+		const Rune *line = LINE(y);
+		int end = y == vt->sel.end.y ? vt->sel.end.x : vt->pty.cols;
+		if (y > vt->sel.start.y && text)
+			text[len] = '\n';
+		len += y > vt->sel.start.y;
+		for (int x = y == vt->sel.start.y ? vt->sel.start.x : 0; x < end; ++x) {
+			size_t n = strnlen((const char*) line[x].u, 4);
+			if (text)
+				memcpy(text + len, line[x].u, n);
+			len += n;
+		}
+	}
+	return len;
+}
+
+// Get the selected text (NULL if the selection is empty)
+static char* sel_text(size_t *len)
+{
+	if (POINT_EQ(vt->sel.end, vt->sel.start))
+		return NULL;
+
+	*len = sel_copy(NULL);
+	char *text = malloc(MAX(*len, 1));
+	if (!text)
+		die("Couldn't copy the selection");
+	sel_copy(text);
+	return text;
+}
+
+// Clear the selection. If it's PRIMARY, keep a copy of its text: other clients may still ask for it.
+static void sel_clear(void)
+{
+	if (vt->sel.primary) {
+		vt->sel.primary = false;
+		vt->sel.text = sel_text(&vt->sel.text_len);
+	}
+	vt->sel.end = vt->sel.start;
+}
+
+// Clear the selection if it covers row `y`, which is about to be modified (called by every
+// writer, so the selection never needs to be checked when drawing)
+static void sel_touch(int y)
+{
+	if (y >= vt->sel.start.y && y < vt->sel.end.y + (vt->sel.end.x > 0))
+		sel_clear();
+}
+
+// Get line number `n` (which must not be compressed) for writing, allocating it if blank
+static Rune *edit_line(int n)
+{
+	Rune **slot = &vt->term.hist[n & (vt->term.hist_size - 1)];
+	vt->term.damage[n & (vt->term.hist_size - 1)] = true;
+	if (*slot)
+		return *slot;
+
+	if (vt->term.spare) {
+		*slot = vt->term.spare;
+		memcpy(&vt->term.spare, (void*) vt->term.spare, sizeof(vt->term.spare));
+	} else if (!(*slot = malloc(sizeof(Rune[LINE_SIZE])))) {
+		die("Couldn't allocate the history");
+	}
+	return memset(*slot, 0, sizeof(Rune[LINE_SIZE]));
+}
+
+// Make line number `n` blank, keeping its memory for later use
+static void blank_line(int n)
+{
+	Rune **slot = &vt->term.hist[n & (vt->term.hist_size - 1)];
+	if (*slot) {
+		vt->term.damage[n & (vt->term.hist_size - 1)] = true;
+		memcpy((void*) *slot, &vt->term.spare, sizeof(vt->term.spare));
+		vt->term.spare = *slot;
+		*slot = NULL;
+	}
+}
+
+// Forget the expanded copy of line `n`, if any
+static void thawed_drop(int n)
+{
+	if (vt->term.thawed && vt->term.thawed[n & (vt->term.hist_size / 2 - 1)].n == n)
+		vt->term.thawed[n & (vt->term.hist_size / 2 - 1)].n = -1;
+}
+
+// Reallocate the ring buffer of compressed lines with `size` entries, keeping the most
+// recent ones and freeing the others
+static void cold_resize(int size)
+{
+	ColdLine **cold = size ? calloc((size_t) size, sizeof(*cold)) : NULL;
+	if (size && !cold)
+		die("Couldn't allocate the history");
+
+	int first_kept = MAX(vt->term.hist_start, vt->term.frozen - MIN(size, vt->term.save_lines));
+	for (int n = MAX(vt->term.hist_start, vt->term.frozen - vt->term.cold_size); n < vt->term.frozen; ++n) {
+		ColdLine *line = vt->term.cold[n & (vt->term.cold_size - 1)];
+		if (n >= first_kept) {
+			cold[n & (size - 1)] = line;
+		} else {
+			sel_touch(n - vt->term.scroll);
+			cold_free(line);
+			thawed_drop(n);
+		}
+	}
+
+	free(vt->term.cold);
+	vt->term.cold = cold;
+	vt->term.cold_size = size;
+	vt->term.hist_start = first_kept;
+	if (!size) {
+		cold_release(vt->term.cold_block);
+		vt->term.cold_block = NULL;
+	}
+}
+
+// Compress the lines that scrolled past the top of the screen (or that of the main screen,
+// when the alternate one is used), or expand them back if the screen grew
+static void hist_freeze(bool thaw)
+{
+	int first_hot = vt->term.lines - vt->term.alt * vt->pty.rows;
+
+	while (thaw && vt->term.frozen > first_hot) {
+		const Rune *line = get_line(vt->term.frozen - 1);
+		--vt->term.frozen;
+		memcpy(edit_line(vt->term.frozen), line, sizeof(Rune[LINE_SIZE]));
+
+		// Only the expanded line is kept: the compressed one would be lost to cold_resize()
+		if (vt->term.frozen >= vt->term.hist_start && vt->term.cold_size) {
+			cold_free(vt->term.cold[vt->term.frozen & (vt->term.cold_size - 1)]);
+			vt->term.cold[vt->term.frozen & (vt->term.cold_size - 1)] = NULL;
+		}
+		thawed_drop(vt->term.frozen);
+	}
+
+	for (; vt->term.frozen < first_hot; ++vt->term.frozen) {
+		for (; vt->term.frozen - vt->term.hist_start >= vt->term.save_lines; ++vt->term.hist_start) {
+			sel_touch(vt->term.hist_start - vt->term.scroll);
+			if (vt->term.hist_start < vt->term.frozen && vt->term.cold_size) {
+				cold_free(vt->term.cold[vt->term.hist_start & (vt->term.cold_size - 1)]);
+				vt->term.cold[vt->term.hist_start & (vt->term.cold_size - 1)] = NULL;
+				thawed_drop(vt->term.hist_start);
+			}
+		}
+		if (!vt->term.save_lines) {
+			blank_line(vt->term.frozen);
+			continue;
+		}
+
+		if (vt->term.frozen - vt->term.hist_start >= vt->term.cold_size)
+			cold_resize(MIN(MAX(2 * vt->term.cold_size, 64), pow2(vt->term.save_lines)));
+
+		ColdLine **slot = &vt->term.cold[vt->term.frozen & (vt->term.cold_size - 1)];
+		cold_free(*slot);
+		*slot = vt->term.hist[vt->term.frozen & (vt->term.hist_size - 1)] ? compress_line(get_line(vt->term.frozen)) : NULL;
+		thawed_drop(vt->term.frozen);
+		blank_line(vt->term.frozen);
+	}
+}
+
+// Reallocate the ring buffer of uncompressed lines with `size` lines, and free the others
+static void hist_resize(int size)
+{
+	Rune **hist = size ? calloc((size_t) size, sizeof(*hist)) : NULL;
+	bool *damage = size ? malloc((size_t) size * sizeof(*damage)) : NULL;
+	if (size && !(hist && damage))
+		die("Couldn't allocate the history");
+	for (int i = 0; i < size; ++i)
+		damage[i] = true;
+
+	int end = MIN(vt->term.lines + vt->pty.rows, vt->term.frozen + vt->term.hist_size);
+	for (int n = MAX(vt->term.frozen, end - size); n < end; ++n) {
+		hist[n & (size - 1)] = vt->term.hist[n & (vt->term.hist_size - 1)];
+		vt->term.hist[n & (vt->term.hist_size - 1)] = NULL;
+	}
+
+	for (int i = 0; i < vt->term.hist_size; ++i)
+		free(vt->term.hist[i]);
+	while (vt->term.spare) {
+		Rune *line = vt->term.spare;
+		memcpy(&vt->term.spare, (void*) line, sizeof(vt->term.spare));
+		free(line);
+	}
+
+	free(vt->term.hist);
+	free(vt->term.damage);
+	free(vt->term.thawed);
+	vt->term.hist = hist;
+	vt->term.damage = damage;
+	vt->term.hist_size = size;
+	vt->term.thawed = NULL;
+}
+
+// Fit the history to the size of the screen and the `save_lines` setting. Uncompressed
+// lines are only kept for the screen, the alternate screen, and the cache used by prepare_frame().
+static void hist_fit(void)
+{
+	hist_freeze(false);
+
+	int size = pow2(3 * vt->pty.rows + 1);
+	if (size != vt->term.hist_size)
+		hist_resize(size);
+
+	hist_freeze(true);
+
+	if (vt->term.cold_size > pow2(vt->term.save_lines) || !vt->term.save_lines)
+		cold_resize(vt->term.save_lines ? pow2(vt->term.save_lines) : 0);
+}
+
 // Is the character at row `y`, column `x` currently selected?
 static bool selected(int x, int y)
 {
-	return BETWEEN(y, sel.start.y, sel.end.y)
-		&& (y != sel.start.y || x >= sel.start.x)
-		&& (y != sel.end.y || x < sel.end.x);
+	return BETWEEN(y, vt->sel.start.y, vt->sel.end.y)
+		&& (y != vt->sel.start.y || x >= vt->sel.start.x)
+		&& (y != vt->sel.end.y || x < vt->sel.end.x);
 }
 
 // Erase characters between columns `start` and `end` in the current line
 static void erase_chars(int y, int start, int end)
 {
-	Rune *line = LINE(y);
+	Rune *line = EDIT_LINE(y);
 	for (int x = start; x < end; ++x)
 		if (!(line[x].attr & ATTR_GUARDED))
-			line[x] = (Rune) { "", 0, 0, cursor.rune.bg };
+			line[x] = (Rune) { "", 0, 0, vt->cursor.rune.bg };
 }
 
 // Erase all characters between lines `start` and `end`
 static void erase_lines(int start, int end)
 {
-	Rune *line = LINE(start);
-	if (cursor.rune.bg || LINE(end) < line || term.guarded)
-		for (int y = start; y < end; ++y)
-			erase_chars(y, 0, pty.cols);
-	else // fast path
-		memset(line, 0, sizeof(Rune) * LINE_SIZE * (end - start));
+	for (int y = start; y < end; ++y) {
+		if (vt->cursor.rune.bg || vt->term.guarded) {
+			erase_chars(y, 0, vt->pty.cols);
+		} else { // fast path
+			sel_touch(y);
+			blank_line(y + vt->term.scroll);
+		}
+	}
 }
 
 // Move lines between `start` and `end` by `diff` rows down
 static void move_lines(int start, int end, int diff)
 {
-	if (sel.start.y >= start && sel.end.y < end) {
-		sel.start.y -= diff;
-		sel.end.y -= diff;
+	// The selection moves with the lines it covers, as long as they stay inside the region
+	bool follow = vt->sel.start.y >= start && vt->sel.end.y < end;
+	if (follow) {
+		vt->sel.start.y -= diff;
+		vt->sel.end.y -= diff;
+		if (vt->sel.start.y < start || vt->sel.end.y > end)
+			sel_clear();
+	}
+
+	// Let the renderer blit the region instead of repainting it. Successive moves of the same
+	// region in the same direction add up.
+	int i = vt->term.num_moves - 1;
+	if (i >= 0 && vt->term.moves[i].start == start && vt->term.moves[i].end == end && (vt->term.moves[i].diff < 0) == (diff < 0)) {
+		vt->term.moves[i].diff += diff;
+		LIMIT(vt->term.moves[i].diff, start - end - 1, end - start + 1);
+	} else if (vt->term.num_moves < (int) LEN(vt->term.moves)) {
+		vt->term.moves[vt->term.num_moves++] = (Move) { start, end, diff };
 	}
 
 	int step = diff < 0 ? -1 : 1;
@@ -203,15 +1020,29 @@ static void move_lines(int start, int end, int diff)
 		SWAP(start, end);
 	int last = end - diff + step;
 
-	for (int y = start; y != last; y += step)
-		memcpy(LINE(y), LINE(y + diff), sizeof(LINE(y)));
+	// Rotate the lines instead of copying them, so the ones that fell off the region
+	// end up in the rows to erase
+	for (int y = start; y != last; y += step) {
+		SWAP(vt->term.hist[(y + vt->term.scroll) & (vt->term.hist_size - 1)],
+				vt->term.hist[(y + diff + vt->term.scroll) & (vt->term.hist_size - 1)]);
+		vt->term.damage[(y + vt->term.scroll) & (vt->term.hist_size - 1)] = true;
+		vt->term.damage[(y + diff + vt->term.scroll) & (vt->term.hist_size - 1)] = true;
+		if (!follow) {
+			sel_touch(y);
+			sel_touch(y + diff);
+		}
+	}
+	for (int y = MIN(last, end); y <= MAX(last, end); ++y) {
+		sel_touch(y);
+		blank_line(y + vt->term.scroll);
+	}
 	erase_lines(MIN(last, end), MAX(last, end) + 1);
 }
 
 // Move characters between columns `start` and `end` of the current line by `diff`
 static void move_chars(int start, int end, int diff)
 {
-	Rune *line = LINE(cursor.y);
+	Rune *line = EDIT_LINE(vt->cursor.y);
 
 	int step = diff < 0 ? -1 : 1;
 	if (diff < 0)
@@ -220,38 +1051,38 @@ static void move_chars(int start, int end, int diff)
 
 	for (int x = start; x != last; x += step)
 		line[x] = line[x + diff];
-	erase_chars(cursor.y, MIN(last, end), MAX(last, end) + 1);
+	erase_chars(vt->cursor.y, MIN(last, end), MAX(last, end) + 1);
 }
 
 // Set the cursor position
 static void move_to(int x, int y)
 {
-	cursor.x = LIMIT(x, 0, pty.cols - 1);
-	cursor.y = LIMIT(y, 0, pty.rows - 1);
+	vt->cursor.x = LIMIT(x, 0, vt->pty.cols - 1);
+	vt->cursor.y = LIMIT(y, 0, vt->pty.rows - 1);
 }
 
 // Scroll the viewport `n` lines down (n < 0: scroll up)
 static void scroll(int n)
 {
-	int min_scroll = MAX(0, term.lines - HIST_SIZE + 2 * pty.rows);
-	LIMIT(n, min_scroll - term.scroll, term.lines - term.scroll);
-	term.scroll += n;
-	sel.mark.y -= n;
-	sel.start.y -= n;
-	sel.end.y -= n;
+	LIMIT(n, vt->term.hist_start - vt->term.scroll, vt->term.lines - vt->term.scroll);
+	vt->term.scroll += n;
+	vt->sel.mark.y -= n;
+	vt->sel.start.y -= n;
+	vt->sel.end.y -= n;
 }
 
 // Move the cursor to the next line, scrolling if necessary
 static void newline()
 {
-	if (cursor.y != term.bot) {
-		move_to(cursor.x, cursor.y + 1);
-	} else if (term.top || term.alt) {
-		move_lines(term.top, term.bot, 1);
+	if (vt->cursor.y != vt->term.bot) {
+		move_to(vt->cursor.x, vt->cursor.y + 1);
+	} else if (vt->term.top || vt->term.alt) {
+		move_lines(vt->term.top, vt->term.bot, 1);
 	} else {
-		++term.lines;
+		++vt->term.lines;
+		hist_freeze(false);
 		scroll(1);
-		move_lines(term.bot, pty.rows - 1, -1);
+		move_lines(vt->term.bot, vt->pty.rows - 1, -1);
 	}
 }
 
@@ -267,115 +1098,396 @@ static Point pixel2cell(int px, int py)
 static void next_point(Point *p)
 {
 	++p->x;
-	if (p->x >= pty.cols)
+	if (p->x >= vt->pty.cols)
 		*p = (Point) { 0, p->y + 1 };
 }
 
-// Copy the selected text to the primary selection (or the clipboard, if `clipboard` is set)
+// Find the view that window `win` belongs to (NULL if it isn't ours)
+static View *find_view(Window win)
+{
+	for (View *v = views; v; v = v->next)
+		if (v->parent == win || v->win == win)
+			return v;
+	return NULL;
+}
+
+// Forget the text of PRIMARY, kept by the terminal of the window that owns it
+static void primary_drop(void)
+{
+	View *v = find_view(owned.owner[0]);
+	if (v) {
+		v->vt->sel.primary = false;
+		free(v->vt->sel.text);
+		v->vt->sel.text = NULL;
+	}
+}
+
+// Take ownership of the primary selection (or the clipboard, if `clipboard` is set). The text of
+// the clipboard is copied now, that of PRIMARY only when another client asks for it: it's kept
+// on the screen until the selection is cleared (see sel_clear()).
 static void copy(bool clipboard)
 {
 	// If the selection is empty, leave the clipboard as-is rather than emptying it
-	if (POINT_EQ(sel.end, sel.start))
+	if (POINT_EQ(vt->sel.end, vt->sel.start))
 		return;
 
-	FILE* pipe = popen(clipboard ? "xsel -bi" : "xsel -i", "w");
-	int y = sel.start.y;
+	if (clipboard) {
+		free(owned.clipboard);
+		owned.clipboard = sel_text(&owned.clipboard_len);
+	} else {
+		primary_drop();
+		vt->sel.primary = true;
+	}
+	owned.owner[clipboard] = view->win;
+	XSetSelectionOwner(w.disp, clipboard ? XA_CLIPBOARD : XA_PRIMARY, view->win, CurrentTime);
+}
+
+// Convert the UTF-8 `text` to Latin-1 in place, replacing the chars it lacks with '?'.
+// Returns the new length.
+static size_t to_latin1(char *text, size_t len)
+{
+	size_t n = 0;
+	for (size_t i = 0; i < len; ++n) {
+		u8 c = (u8) text[i++];
+		if (c < 0x80) {
+			text[n] = (char) c;
+		} else if ((c == 0xC2 || c == 0xC3) && i < len && ((u8) text[i] & 0xC0) == 0x80) {
+			text[n] = (char) ((c & 3) << 6 | ((u8) text[i++] & 0x3F));
+		} else {
+			text[n] = '?';
+			while (i < len && ((u8) text[i] & 0xC0) == 0x80)
+				++i;
+		}
+	}
+	return n;
+}
+
+// Copy the text of one of our selections (NULL if we don't own it)
+static char* owned_text(bool clipboard, size_t *len)
+{
+	View *v = find_view(owned.owner[clipboard]);
+	if (!v)
+		return NULL;
+	if (!clipboard && v->vt->sel.primary) {
+		Terminal *caller = vt;
+		vt = v->vt;
+		char *text = sel_text(len);
+		vt = caller;
+		return text;
+	}
+
+	const char *kept = clipboard ? owned.clipboard : v->vt->sel.text;
+	*len = clipboard ? owned.clipboard_len : v->vt->sel.text_len;
+	char *text = kept ? malloc(MAX(*len, 1)) : NULL;
+	if (kept && !text)
+		die("Couldn't send the selection");
+	return kept ? memcpy(text, kept, *len) : NULL;
+}
+
+// Stop the INCR transfer in progress. Its requestor only stops reporting property changes to us
+// if it isn't one of our windows, which need them for themselves.
+static void transfer_end(void)
+{
+	if (!find_view(owned.requestor))
+		XSelectInput(w.disp, owned.requestor, NoEventMask);
+	free(owned.data);
+	owned.data = NULL;
+}
+
+// Send the text of one of our selections to another client. Large texts are sent in chunks,
+// using the INCR protocol, see on_transfer_property().
+static void on_selection_request(XSelectionRequestEvent *e)
+{
+	XSelectionEvent reply = {
+		.type = SelectionNotify, .requestor = e->requestor, .selection = e->selection,
+		.target = e->target, .property = None, .time = e->time,
+	};
+	Atom property = e->property ? e->property : e->target; // obsolete clients leave it unset
+	bool clipboard = e->selection == XA_CLIPBOARD;
+	char *text;
+	size_t len;
+
+	if (e->target == XA_TARGETS) {
+		Atom targets[] = { XA_TARGETS, XA_UTF8_STRING, XA_STRING };
+		XChangeProperty(w.disp, e->requestor, property, XA_ATOM, 32, PropModeReplace,
+				(u8*) targets, (int) LEN(targets));
+		reply.property = property;
+	} else if ((e->target == XA_UTF8_STRING || e->target == XA_STRING) && (text = owned_text(clipboard, &len))) {
+		if (e->target == XA_STRING)
+			len = to_latin1(text, len);
+
+		if (len <= owned.chunk) {
+			XChangeProperty(w.disp, e->requestor, property, e->target, 8, PropModeReplace, (u8*) text, (int) len);
+			reply.property = property;
+			free(text);
+		} else {
+			// Only one INCR transfer at a time: a new one replaces the previous
+			if (owned.data)
+				transfer_end();
+			owned.data = text;
+			owned.len = len;
+			owned.pos = 0;
+			owned.requestor = e->requestor;
+			owned.property = property;
+			owned.type = e->target;
+			if (!find_view(e->requestor))
+				XSelectInput(w.disp, e->requestor, PropertyChangeMask);
+			XChangeProperty(w.disp, e->requestor, property, XA_INCR, 32, PropModeReplace,
+					(u8*) &(long) { (long) len }, 1);
+			reply.property = property;
+		}
+	}
+
+	XSendEvent(w.disp, e->requestor, False, 0, (XEvent*) &reply);
+}
+
+// The requestor of an INCR transfer deleted the last chunk: send the next one (an empty chunk ends it)
+static void on_transfer_property(XPropertyEvent *e)
+{
+	(void) e;
+	size_t len = MIN(owned.len - owned.pos, owned.chunk);
+	XChangeProperty(w.disp, owned.requestor, owned.property, owned.type, 8, PropModeReplace,
+			(u8*) owned.data + owned.pos, (int) len);
+	owned.pos += len;
+
+	if (!len)
+		transfer_end();
+}
 
-	for (Point p = sel.start; POINT_LT(p, sel.end); next_point(&p)) {
-		u8 *text = LINE(p.y)[p.x].u;
-		if (p.y > y)
-			fputc('\n', pipe);
-		y = p.y;
-		fprintf(pipe, "%.4s", text);
+// Another client (or another of our windows, which has its own copy) took one of our selections
+static void on_selection_clear(XSelectionClearEvent *e)
+{
+	bool clipboard = e->selection == XA_CLIPBOARD;
+	if (e->window != owned.owner[clipboard])
+		return;
+	if (clipboard) {
+		free(owned.clipboard);
+		owned.clipboard = NULL;
+	} else {
+		primary_drop();
 	}
+	owned.owner[clipboard] = None;
+}
 
-	pclose(pipe);
+// Append `len` bytes to the pasted text, converting them from Latin-1 if `latin1` is set.
+// Newlines are sent as carriage returns, like the Enter key.
+static void paste_append(const char *data, size_t len, bool latin1)
+{
+	if (!len)
+		return;
+	char *text = realloc(view->pasting.text, view->pasting.len + 2 * len);
+	if (!text)
+		die("Couldn't paste");
+	view->pasting.text = text;
+
+	for (size_t i = 0; i < len; ++i) {
+		u8 c = (u8) data[i];
+		if (latin1 && c >= 0x80) {
+			text[view->pasting.len++] = (char) (0xC0 | c >> 6);
+			text[view->pasting.len++] = (char) (0x80 | (c & 0x3F));
+		} else {
+			text[view->pasting.len++] = c == '\n' ? '\r' : (char) c;
+		}
+	}
 }
 
-// Print the primary selection (or the clipboard, if `clipboard` is set) to the terminal
+// The selection has arrived entirely (or its owner stopped answering): close the bracketed paste
+static void paste_received(void)
+{
+	if (view->pasting.bracketed)
+		paste_append(CSI "201~", 6, false);
+	view->pasting.selection = None;
+	view->pasting.incr = false;
+	view->pasting.bracketed = false;
+}
+
+// Ask the owner of the primary selection (or the clipboard, if `clipboard` is set) for its
+// contents. They arrive later, through on_selection_notify(). A paste requested while another
+// is in progress waits for it to be complete, unless the owner of the other one stopped answering.
 static void paste(bool clipboard)
 {
-	if (term.bracketed_paste)
-		printf(CSI "200~");
+	Atom selection = clipboard ? XA_CLIPBOARD : XA_PRIMARY;
+	if (view->pasting.selection && now() - view->pasting.heard > PASTE_TIMEOUT)
+		paste_received();
+	if (view->pasting.selection || view->pasting.text) {
+		view->pasting.next = selection;
+		return;
+	}
+	view->pasting.selection = selection;
+	view->pasting.target = XA_UTF8_STRING;
+	view->pasting.heard = now();
+	XConvertSelection(w.disp, selection, XA_UTF8_STRING, XA_PASTE, view->win, CurrentTime);
+}
 
-	system(clipboard ? "xsel -bo | tr '\n' '\r'" : "xsel -o | tr '\n' '\r'");
+// Append the contents of the paste property to the pasted text, and delete it so the owner can
+// send the next chunk. Returns the length of the chunk, or -1 if the owner is starting an INCR transfer.
+static long paste_chunk(void)
+{
+	Atom type;
+	int format;
+	unsigned long len, left = 1;
+	unsigned char *data;
+	long total = 0;
+
+	// Read it in pieces of 256 KiB (the offset counts 32-bit units); it is only deleted
+	// once the last piece has been read
+	for (long offset = 0; left; offset += (long) len / 4) {
+		if (XGetWindowProperty(w.disp, view->win, XA_PASTE, offset, 1 << 16, True, AnyPropertyType,
+					&type, &format, &len, &left, &data) != Success)
+			break;
+		if (type == XA_INCR) {
+			XFree(data);
+			return -1;
+		}
+		if (format == 8)
+			paste_append((char*) data, len, type == XA_STRING);
+		XFree(data);
+		total += (long) len;
+		if (format != 8)
+			break;
+	}
+	return total;
+}
 
-	if (term.bracketed_paste)
-		printf(CSI "201~");
+// The selection we asked for in paste() is ready: take it all, or wait for it to arrive in
+// chunks if it is large (INCR)
+static void on_selection_notify(XSelectionEvent *e)
+{
+	if (e->selection != view->pasting.selection)
+		return;
+
+	view->pasting.heard = now();
+	if (e->property == None) {
+		// Older owners only support STRING (Latin-1)
+		if (view->pasting.target == XA_UTF8_STRING) {
+			view->pasting.target = XA_STRING;
+			XConvertSelection(w.disp, view->pasting.selection, XA_STRING, XA_PASTE, view->win, CurrentTime);
+		} else {
+			view->pasting.selection = None;
+		}
+		return;
+	}
+
+	view->pasting.bracketed = vt->term.bracketed_paste;
+	if (view->pasting.bracketed)
+		paste_append(CSI "200~", 6, false);
+
+	view->pasting.incr = paste_chunk() < 0;
+	if (!view->pasting.incr)
+		paste_received();
 }
 
-// Compute the djb2 hash of the contents of the selection
-static u64 sel_get_hash()
+// Take the next chunk of an INCR transfer (an empty chunk ends it)
+static void on_paste_property(XPropertyEvent *e)
 {
-	u64 hash = 5381;
+	(void) e;
+	if (!view->pasting.incr)
+		return;
+	view->pasting.heard = now();
+	if (paste_chunk() == 0)
+		paste_received();
+}
 
-	for (Point p = sel.start; POINT_LT(p, sel.end); next_point(&p))
-		hash = (hash << 5) + hash + LINE(p.y)[p.x].u[0];
+// Queue the pasted text for the pty a little at a time, as the application reads it, so that
+// a large paste never fills the output queue. Starts the next paste once this one is complete.
+static void paste_feed(void)
+{
+	if (vt->out.len < PASTE_CHUNK && view->pasting.pos < view->pasting.len) {
+		size_t len = MIN(view->pasting.len - view->pasting.pos, PASTE_CHUNK);
+		pty_write(view->pasting.text + view->pasting.pos, (int) len);
+		view->pasting.pos += len;
+	}
+	if (view->pasting.selection || view->pasting.pos < view->pasting.len)
+		return;
 
-	return hash;
+	free(view->pasting.text);
+	view->pasting.text = NULL;
+	view->pasting.len = view->pasting.pos = 0;
+	if (view->pasting.next) {
+		bool clipboard = view->pasting.next == XA_CLIPBOARD;
+		view->pasting.next = None;
+		paste(clipboard);
+	}
 }
 
 // Set the selection’s point (last position selected)
 static void sel_set_point(Point point)
 {
+	sel_clear(); // the previous selection may still be PRIMARY
+
 	// `point` can be before `mark` (if the user drags the mouse up/left),
 	// but `end` should always be after `start`
-	bool swapped = POINT_LT(point, sel.mark);
-	sel.start = swapped ? point : sel.mark;
-	sel.end = swapped ? sel.mark : point;
-
-	if (sel.snap == SNAP_LINE) {
-		sel.start.x = sel.end.x = 0;
-		++sel.end.y;
-		while (sel.start.y > 0 && LINE(sel.start.y - 1)[pty.cols - 1].u[0])
-			--sel.start.y;
-		while (LINE(sel.end.y - 1)[pty.cols - 1].u[0])
-			++sel.end.y;
-	} else if (sel.snap == SNAP_WORD) {
-		while (sel.start.x > 0 && !IS_DELIM(LINE(sel.start.y)[sel.start.x - 1].u))
-			--sel.start.x;
-		while (!IS_DELIM(LINE(sel.end.y)[sel.end.x].u))
-			next_point(&sel.end);
+	bool swapped = POINT_LT(point, vt->sel.mark);
+	vt->sel.start = swapped ? point : vt->sel.mark;
+	vt->sel.end = swapped ? vt->sel.mark : point;
+
+	if (vt->sel.snap == SNAP_LINE) {
+		vt->sel.start.x = vt->sel.end.x = 0;
+		++vt->sel.end.y;
+		while (vt->sel.start.y > 0 && LINE(vt->sel.start.y - 1)[vt->pty.cols - 1].u[0])
+			--vt->sel.start.y;
+		while (LINE(vt->sel.end.y - 1)[vt->pty.cols - 1].u[0])
+			++vt->sel.end.y;
+	} else if (vt->sel.snap == SNAP_WORD) {
+		while (vt->sel.start.x > 0 && !IS_DELIM(LINE(vt->sel.start.y)[vt->sel.start.x - 1].u))
+			--vt->sel.start.x;
+		while (!IS_DELIM(LINE(vt->sel.end.y)[vt->sel.end.x].u))
+			next_point(&vt->sel.end);
 	}
+}
 
-	sel.hash = sel_get_hash();
+static void term_init()
+{
+	hist_fit();
+	vt->term.top = 0;
+	vt->term.bot = vt->pty.rows - 1;
+	for (u64 x = 0; x < LINE_SIZE; x += 8)
+		vt->term.tabs[x] = true;
 }
 
-// Exit after a failed syscall
-static void __attribute__((noreturn)) die(const char* message)
+// Resize the screen of `t` to `rows` × `cols` (clamped to the supported range)
+static void term_resize(Terminal *t, int rows, int cols)
 {
-	perror(message);
-	exit(1);
+	Terminal *caller = vt;
+	vt = t;
+	vt->pty.cols = LIMIT(cols, 1, LINE_SIZE - 1);
+	vt->pty.rows = LIMIT(rows, 1, MAX_ROWS);
+	term_init();
+	move_to(vt->cursor.x, vt->cursor.y);
+	vt = caller;
 }
 
-static void term_init()
+// Release everything allocated by `t`
+static void term_free(Terminal *t)
 {
-	term.top = 0;
-	term.bot = pty.rows - 1;
-	for (u64 x = 0; x < LINE_SIZE; x += 8)
-		term.tabs[x] = true;
+	Terminal *caller = vt;
+	vt = t;
+	cold_resize(0);
+	hist_resize(0);
+	free(vt->out.buf);
+	free(vt->sel.text);
+	free(t);
+	vt = caller == t ? NULL : caller;
 }
 
 // Recompute the number of text rows/columns from the given pixel dimensions
 static void fix_pty_size(int width, int height)
 {
-	Point old_size = { pty.cols, pty.rows };
+	Point old_size = { vt->pty.cols, vt->pty.rows };
 	Point new_size = pixel2cell(width - w.border, height - w.border);
 	if (POINT_EQ(old_size, new_size))
 		return;
 
-	pty.cols = LIMIT(new_size.x, 1, LINE_SIZE - 1);
-	pty.rows = LIMIT(new_size.y, 1, HIST_SIZE / 2);
-	term_init();
-	move_to(cursor.x, cursor.y);
+	term_resize(vt, new_size.y, new_size.x);
+	view->dirty = true;
 
 	// Send our size to the pty driver so that applications can query it
-	struct winsize size = { (u16) pty.rows, (u16) pty.cols, 0, 0 };
-	if (ioctl(pty.fd, TIOCSWINSZ, &size) < 0)
+	struct winsize size = { (u16) vt->pty.rows, (u16) vt->pty.cols, 0, 0 };
+	if (ioctl(vt->pty.fd, TIOCSWINSZ, &size) < 0)
 		perror("Couldn't set pty size");
 
 	// Resize the inner window to align it with the character grid
-	XResizeWindow(w.disp, w.win, pty.cols * w.font_width, pty.rows * w.font_height);
+	XResizeWindow(w.disp, view->win, vt->pty.cols * w.font_width, vt->pty.rows * w.font_height);
 }
 
 // Default value of component `rgb` (0=red, 1=green, 2=blue) of color `i`
@@ -410,61 +1522,143 @@ static const char* get_resource(const char* resource, const char* fallback)
 	return result ? result : fallback;
 }
 
-// Read the X resources used for configuration and take action accordingly
-static void load_resources()
+// Get font `font` (0: regular, 1: bold, 2: italic, 3: bold italic), opening it the first time
+// it is needed: most sessions never show italic text
+static XftFont *get_font(int font)
 {
-	// Fonts
-	const char *face_name = get_resource("faceName", "mono");
-	const char *style[] = { "", "bold", "italic", "bold italic" };
+	static const char *style[] = { "", "bold", "italic", "bold italic" };
 	char font_name[128];
 
+	if (!w.font[font]) {
+		snprintf(font_name, sizeof(font_name), "%s:style=%s", get_resource("faceName", "mono"), style[font]);
+		w.font[font] = XftFontOpenName(w.disp, w.screen, font_name);
+	}
+	return w.font[font];
+}
+
+// Open the regular font named by the faceName resource (the other styles are opened on demand)
+static void load_fonts(void)
+{
 	for (int i = 0; i < 4; ++i) {
-		sprintf(font_name, "%s:style=%s", face_name, style[i]);
 		if (w.font[i])
 			XftFontClose(w.disp, w.font[i]);
-		w.font[i] = XftFontOpenName(w.disp, w.screen, font_name);
+		w.font[i] = NULL;
+	}
+	get_font(0);
+	zeromem(glyph_cache);
+}
+
+// Parse the RGB color specifications `#rgb`, `#rrggbb`… and `rgb:r/g/b` without asking the
+// server, the way XParseColor does. Returns false for anything else, such as color names.
+static bool parse_color(const char *spec, XRenderColor *color)
+{
+	static const char hex[] = "0123456789abcdefABCDEF";
+	u16 rgb[3];
+
+	if (spec[0] == '#') {
+		int len = (int) strlen(++spec), digits = len / 3;
+		if (digits < 1 || digits > 4 || len != 3 * digits || (int) strspn(spec, hex) != len)
+			return false;
+		for (int i = 0; i < 3; ++i) {
+			char field[5] = "";
+			memcpy(field, spec + i * digits, (size_t) digits);
+			rgb[i] = (u16) (strtoul(field, NULL, 16) << (16 - 4 * digits));
+		}
+	} else if (!strncasecmp(spec, "rgb:", 4)) {
+		spec += 4;
+		for (int i = 0; i < 3; ++i) {
+			int digits = (int) strspn(spec, hex);
+			if (digits < 1 || digits > 4 || spec[digits] != (i < 2 ? '/' : '\0'))
+				return false;
+			rgb[i] = (u16) (strtoul(spec, NULL, 16) * 65535 / ((1ul << 4 * digits) - 1));
+			spec += digits + 1;
+		}
+	} else {
+		return false;
 	}
 
+	*color = (XRenderColor) { rgb[0], rgb[1], rgb[2], 0xffff };
+	return true;
+}
+
+// Make `v` (and its terminal) the window the front end works on
+static void select_view(View *v)
+{
+	view = v;
+	vt = v ? v->vt : NULL;
+}
+
+// Apply the X resources to the selected window
+static void configure_view(void)
+{
+	XSetWindowBackground(w.disp, view->parent, w.border_color);
+	XClearWindow(w.disp, view->parent);
+	XMoveWindow(w.disp, view->win, w.border, w.border);
+	vt->term.meta_sends_escape = is_true(get_resource("metaSendsEscape", ""));
+	vt->term.bold_as_bright = is_true(get_resource("showBoldAsBright", "yes"));
+	vt->term.save_lines = MAX(0, atoi(get_resource("saveLines", "2048")));
+	view->frame.interval = 1000000000 / (u64) MIN(MAX(atoi(get_resource("frameRate", "60")), 1), 1000);
+	view->frame.show_timings = is_true(get_resource("showFrameTimings", ""));
+	if (vt->term.hist)
+		hist_fit();
+	view->dirty = true;
+}
+
+// Read the X resources used for configuration and take action accordingly, in every window
+static void load_resources()
+{
+	// Fonts
+	u64 start = now();
+	load_fonts();
+	startup.fonts += now() - start;
+
 	XGlyphInfo extents;
 	XftTextExtentsUtf8(w.disp, w.font[0], (const FcChar8 *) "Q", 1, &extents);
 	double scale_height = atof(get_resource("scaleHeight", "1"));
 	w.font_height = (int) ((w.font[0]->height + 1) * scale_height + .999);
 	w.font_width = extents.xOff;
 
-	// Colors
+	// Colors: only names (rather than RGB values) cost a round trip to the server
 	Colormap colormap = DefaultColormap(w.disp, w.screen);
 	char resource_name[16] = "color";
-	char def[16] = "";
 	XColor color;
 
 	for (u16 i = 0; i < 256; ++i) {
 		sprintf(resource_name + 5, "%d", i);
-		sprintf(def, "#%02x%02x%02x", default_color(i, 2), default_color(i, 1), default_color(i, 0));
-		XLookupColor(w.disp, colormap, get_resource(resource_name, def), &color, &color);
-		w.colors[i].color = (XRenderColor) { color.red, color.green, color.blue, 0xffff };
+		const char *spec = get_resource(resource_name, NULL);
+		XRenderColor *rgb = &w.colors[i].color;
+		*rgb = (XRenderColor) { (u16) (default_color(i, 2) << 8), (u16) (default_color(i, 1) << 8),
+				(u16) (default_color(i, 0) << 8), 0xffff };
+		if (spec && !parse_color(spec, rgb) && XLookupColor(w.disp, colormap, spec, &color, &color))
+			*rgb = (XRenderColor) { color.red, color.green, color.blue, 0xffff };
 	}
 
 	XAllocNamedColor(w.disp, colormap, get_resource("borderColor", "#000"), &color, &color);
-	XSetWindowBackground(w.disp, w.parent, color.pixel);
-	XClearWindow(w.disp, w.parent);
+	w.border_color = color.pixel;
 
 	// Others
 	w.border = atoi(get_resource("internalBorder", "2"));
-	XMoveWindow(w.disp, w.win, w.border, w.border);
-	term.meta_sends_escape = is_true(get_resource("metaSendsEscape", ""));
-	term.bold_as_bright = is_true(get_resource("showBoldAsBright", "yes"));
-	w.dirty = true;
+	for (View *v = views; v; v = v->next) {
+		select_view(v);
+		configure_view();
+	}
 }
 
 // Keep Valgrind from complaining
 static void clean_exit(void)
 {
+	for (View *v = views; v; v = v->next) {
+		term_free(v->vt);
+		if (v->buf)
+			XFreePixmap(w.disp, v->buf);
+	}
 	for (int i = 0; i < 4; ++i)
-		XftFontClose(w.disp, w.font[i]);
+		if (w.font[i])
+			XftFontClose(w.disp, w.font[i]);
 	XCloseDisplay(w.disp);
 }
 
-// Connect to the X server and set up our windows (gritty X11 stuff)
+// Connect to the X server, and load what all windows share (gritty X11 stuff)
 static void x_init(void)
 {
 	if (!(w.disp = XOpenDisplay(0))) {
@@ -472,182 +1666,433 @@ static void x_init(void)
 		exit(1);
 	}
 
+	startup.connected = now();
 	w.screen = XDefaultScreen(w.disp);
 	setlocale(LC_CTYPE, ""); // required to parse keypresses correctly
 	XSetLocaleModifiers(""); // Xlib leaks memory if we don’t call this
+	XSelectInput(w.disp, XRootWindow(w.disp, w.screen), PropertyChangeMask);
+	w.cursor = XCreateFontCursor(w.disp, XC_xterm);
 
-	Window root = XRootWindow(w.disp, DefaultScreen(w.disp));
-	XSelectInput(w.disp, root, PropertyChangeMask);
+	load_resources();
+	atexit(clean_exit);
 
-	w.parent = XCreateSimpleWindow(w.disp, root, 0, 0, 1, 1, 0, None, None);
-	XDefineCursor(w.disp, w.parent, XCreateFontCursor(w.disp, XC_xterm));
-	XSelectInput(w.disp, w.parent, ExposureMask | FocusChangeMask | StructureNotifyMask
+	XA_DELETE_WINDOW = XInternAtom(w.disp, "WM_DELETE_WINDOW", False);
+	XA_CLIPBOARD = XInternAtom(w.disp, "CLIPBOARD", False);
+	XA_UTF8_STRING = XInternAtom(w.disp, "UTF8_STRING", False);
+	XA_INCR = XInternAtom(w.disp, "INCR", False);
+	XA_PASTE = XInternAtom(w.disp, "VVVVVT_PASTE", False);
+	XA_TARGETS = XInternAtom(w.disp, "TARGETS", False);
+	owned.chunk = (size_t) XMaxRequestSize(w.disp); // a quarter of the maximum, in bytes
+}
+
+// Create and map the windows of the selected view
+static void x_open_window(void)
+{
+	view->parent = XCreateSimpleWindow(w.disp, XRootWindow(w.disp, w.screen), 0, 0, 1, 1, 0, None, None);
+	XDefineCursor(w.disp, view->parent, w.cursor);
+	XSelectInput(w.disp, view->parent, FocusChangeMask | StructureNotifyMask
 			| KeyPressMask | PointerMotionMask | ButtonPressMask | ButtonReleaseMask);
-	XStoreName(w.disp, w.parent, "vvvvvt");
+	XStoreName(w.disp, view->parent, "vvvvvt");
+	XSetWMProtocols(w.disp, view->parent, (Atom[]) { XA_DELETE_WINDOW }, 1);
+
+	view->win = XCreateSimpleWindow(w.disp, view->parent, 0, 0, 1, 1, 0, None, None);
+	XChangeWindowAttributes(w.disp, view->win, CWBitGravity, &(XSetWindowAttributes) { .bit_gravity = NorthWestGravity });
+	XSelectInput(w.disp, view->win, ExposureMask | PropertyChangeMask);
+	view->draw = XftDrawCreate(w.disp, view->win, DefaultVisual(w.disp, w.screen), DefaultColormap(w.disp, w.screen));
+	view->gc = XCreateGC(w.disp, view->win, GCGraphicsExposures, &(XGCValues) { .graphics_exposures = False });
+
+	configure_view();
+	startup.configured = now();
+	XMapWindow(w.disp, view->parent);
+	XMapWindow(w.disp, view->win);
+	XResizeWindow(w.disp, view->parent, 80 * w.font_width + 2 * w.border, 24 * w.font_height + 2 * w.border);
+}
 
-	w.win = XCreateSimpleWindow(w.disp, w.parent, 0, 0, 1, 1, 0, None, None);
-	XChangeWindowAttributes(w.disp, w.win, CWBitGravity, &(XSetWindowAttributes) { .bit_gravity = NorthWestGravity });
-	w.draw = XftDrawCreate(w.disp, w.win, DefaultVisual(w.disp, DefaultScreen(w.disp)), None);
+// Destroy the windows of the selected view
+static void x_close_window(void)
+{
+	if (owned.owner[0] == view->win)
+		owned.owner[0] = None; // the terminal frees its copy of PRIMARY
+	if (owned.owner[1] == view->win) {
+		free(owned.clipboard);
+		owned.clipboard = NULL;
+		owned.owner[1] = None;
+	}
+	XftDrawDestroy(view->draw);
+	XFreeGC(w.disp, view->gc);
+	if (view->buf)
+		XFreePixmap(w.disp, view->buf);
+	XDestroyWindow(w.disp, view->parent);
+}
 
-	w.font_width = w.font_height = 8;
-	load_resources();
-	atexit(clean_exit);
-	XMapWindow(w.disp, w.parent);
-	XMapWindow(w.disp, w.win);
-	XResizeWindow(w.disp, w.parent, 80 * w.font_width + 2 * w.border, 24 * w.font_height + 2 * w.border);
+// Get the index of the glyph for char `c` (UTF-8 bytes packed in a u32) in `w.font[font]`
+static FT_UInt get_glyph(u32 c, int font)
+{
+	__typeof(*glyph_cache) *entry = &glyph_cache[((c * 2654435761u) >> 20 ^ (u32) font) % LEN(glyph_cache)];
 
-	XA_DELETE_WINDOW = XInternAtom(w.disp, "WM_DELETE_WINDOW", False);
-	XSetWMProtocols(w.disp, w.parent, (Atom[]) { XA_DELETE_WINDOW }, 1);
+	if (entry->c != c || entry->font != font) {
+		FcChar32 ucs4;
+		FcUtf8ToUcs4((const FcChar8*) &c, &ucs4, sizeof(c));
+		*entry = (__typeof(*entry)) { c, font, XftCharIndex(w.disp, w.font[font], ucs4) };
+	}
+	return entry->glyph;
+}
+
+// Get the color of the given palette index (+256 for a faint version)
+static XftColor get_color(int color)
+{
+	XftColor result = w.colors[color & 255];
+	if (color > 255) {
+		result.color.red /= 2;
+		result.color.green /= 2;
+		result.color.blue /= 2;
+	}
+	return result;
 }
 
-// Draw the given text on screen
-static void draw_text(Rune rune, u8 *text, int num_chars, int num_bytes, Point pos)
+// Sort the indices of `colors` by color, and compute where each color starts in `order`
+static void sort_by_color(const u16 *colors, int n, int *order, int start[513])
+{
+	int pos[512] = { 0 };
+
+	memset(start, 0, sizeof(int[513]));
+	for (int i = 0; i < n; ++i)
+		++start[colors[i] + 1];
+	for (int c = 0; c < 512; ++c)
+		pos[c] = start[c + 1] += start[c];
+	for (int i = n - 1; i >= 0; --i)
+		order[--pos[colors[i]]] = i;
+}
+
+// Fill the batched rectangles of kind `kind`, with a single request per color
+static void fill_rects(int kind)
+{
+	static XRectangle sorted[BATCH_SIZE];
+	static int order[BATCH_SIZE];
+	int start[513];
+
+	sort_by_color(batch.rect_colors[kind], batch.num_rects[kind], order, start);
+	for (int i = 0; i < batch.num_rects[kind]; ++i)
+		sorted[i] = batch.rects[kind][order[i]];
+
+	for (int c = 0; c < 512; ++c) {
+		if (start[c] == start[c + 1])
+			continue;
+		XftColor color = get_color(c);
+		XRenderFillRectangles(w.disp, PictOpSrc, XftDrawPicture(view->draw), &color.color,
+				sorted + start[c], start[c + 1] - start[c]);
+	}
+}
+
+// Send all batched drawing requests to the X server
+static void flush_batch(void)
+{
+	static XftGlyphFontSpec sorted[BATCH_SIZE];
+	static int order[BATCH_SIZE];
+	int start[513];
+
+	// Draw the backgrounds, then the text and decorations, clipped to the redrawn cells
+	XftDrawSetClip(view->draw, 0);
+	fill_rects(0);
+	XftDrawSetClipRectangles(view->draw, 0, 0, batch.rects[0], batch.num_rects[0]);
+
+	sort_by_color(batch.glyph_colors, batch.num_glyphs, order, start);
+	for (int i = 0; i < batch.num_glyphs; ++i)
+		sorted[i] = batch.glyphs[order[i]];
+
+	for (int c = 0; c < 512; ++c) {
+		if (start[c] == start[c + 1])
+			continue;
+		XftColor color = get_color(c);
+		XftDrawGlyphFontSpec(view->draw, &color, sorted + start[c], start[c + 1] - start[c]);
+	}
+
+	fill_rects(1);
+	batch.num_glyphs = batch.num_rects[0] = batch.num_rects[1] = 0;
+}
+
+// Add a rectangle of kind `kind` (0: background, 1: decoration) to the batch
+static void batch_rect(int kind, int color, int x, int y, int width, int height)
+{
+	int i = batch.num_rects[kind]++;
+	batch.rects[kind][i] = (XRectangle) { (short) x, (short) y, (u16) width, (u16) height };
+	batch.rect_colors[kind][i] = (u16) color;
+}
+
+// Draw the given chars (UTF-8 bytes packed in u32s) on screen
+static void draw_text(Rune rune, const u32 *chars, int num_chars, Point pos)
 {
 	int x = pos.x * w.font_width;
 	int y = pos.y * w.font_height;
-	XRectangle r = { 0, 0, (short) (num_chars * w.font_width), (short) w.font_height };
+	int width = num_chars * w.font_width;
 	bool bold = (rune.attr & ATTR_BOLD) != 0;
 	bool italic = (rune.attr & (ATTR_ITALIC | ATTR_BLINK)) != 0;
-	XftFont *font = w.font[bold + 2 * italic];
-	XftColor fg = w.colors[rune.fg];
-	XftColor bg = w.colors[rune.bg];
-	int baseline = y + font->ascent;
-
-	if (rune.attr & ATTR_INVISIBLE) {
+	int font = bold + 2 * italic;
+	int fg = rune.fg;
+	int bg = rune.bg;
+	int baseline = y + get_font(font)->ascent;
+	++perf.draw_calls;
+	perf.cells += (u64) num_chars;
+
+	if (rune.attr & ATTR_INVISIBLE)
 		fg = bg;
-	} else if (rune.attr & ATTR_FAINT) {
-		fg.color.red /= 2;
-		fg.color.green /= 2;
-		fg.color.blue /= 2;
-	}
+	else if (rune.attr & ATTR_FAINT)
+		fg += 256;
 
 	if (rune.attr & ATTR_REVERSE)
 		SWAP(fg, bg);
 
-	// Draw the background, then the text, then decorations
-	XftDrawSetClipRectangles(w.draw, x, y, &r, 1);
-	XftDrawRect(w.draw, &bg, x, y, r.width, r.height);
-	XftDrawStringUtf8(w.draw, &fg, font, x, baseline, text, num_bytes);
+	if (batch.num_glyphs + num_chars > BATCH_SIZE || batch.num_rects[1] + 3 > BATCH_SIZE
+			|| batch.num_rects[0] == BATCH_SIZE)
+		flush_batch();
+
+	batch_rect(0, bg, x, y, width, w.font_height);
+
+	for (int i = 0; i < num_chars; ++i) {
+		batch.glyphs[batch.num_glyphs] = (XftGlyphFontSpec) {
+			w.font[font], get_glyph(chars[i], font), (short) (x + i * w.font_width), (short) baseline
+		};
+		batch.glyph_colors[batch.num_glyphs++] = (u16) fg;
+	}
 
 	if (rune.attr & ATTR_UNDERLINE)
-		XftDrawRect(w.draw, &fg, x, baseline + 1, r.width, 1);
+		batch_rect(1, fg, x, baseline + 1, width, 1);
 
 	if (rune.attr & ATTR_STRUCK)
-		XftDrawRect(w.draw, &fg, x, (2 * baseline + y) / 3, r.width, 1);
+		batch_rect(1, fg, x, (2 * baseline + y) / 3, width, 1);
 
 	if (rune.attr & ATTR_BAR)
-		XftDrawRect(w.draw, &fg, x, y, 2, w.font_height);
+		batch_rect(1, fg, x, y, 2, w.font_height);
 }
 
-// Check the cell at position `pos`, redraw it if necessary
-static void draw_rune(Point pos, Rune *cached_rune)
+// Get the cell at position `pos` as it should appear on screen, with ATTR_DIRTY set if it
+// changed since it was last drawn
+static Rune prepare_rune(Point pos, Rune *cached_rune)
 {
-	static u8 buf[4 * LINE_SIZE];
-	static int len;
-	static Rune prev;
-	static Point prev_pos;
-
 	Rune rune = LINE(pos.y)[pos.x];
 
 	// Default colors
-	u8 *defaulted = term.reverse_video ? &rune.bg : &rune.fg;
+	u8 *defaulted = vt->term.reverse_video ? &rune.bg : &rune.fg;
 	if (*defaulted == 0)
 		*defaulted = 15;
 
-	if (rune.fg < 8 && (rune.attr & ATTR_BOLD) && term.bold_as_bright)
+	if (rune.fg < 8 && (rune.attr & ATTR_BOLD) && vt->term.bold_as_bright)
 		rune.fg |= 8;
 
 	// Add special attributes to render the selection and cursor
-	if (pos.x != pty.cols && selected(pos.x, pos.y))
+	if (pos.x != vt->pty.cols && selected(pos.x, pos.y))
 		rune.attr ^= ATTR_REVERSE;
 
-	Point adjusted_pos = { pos.x, pos.y + term.scroll - term.lines };
-	if (!term.hide && POINT_EQ(adjusted_pos, cursor)) {
-		rune.attr ^= w.focused && term.cursor_style < 3 ? ATTR_REVERSE :
-			term.cursor_style < 5 ? ATTR_UNDERLINE : ATTR_BAR;
+	Point adjusted_pos = { pos.x, pos.y + vt->term.scroll - vt->term.lines };
+	if (!vt->term.hide && POINT_EQ(adjusted_pos, vt->cursor)) {
+		rune.attr ^= view->focused && vt->term.cursor_style < 3 ? ATTR_REVERSE :
+			vt->term.cursor_style < 5 ? ATTR_UNDERLINE : ATTR_BAR;
 	}
 
 	// Mark the cell as dirty if it changed since last time
-	if (w.dirty || memcmp(&rune, cached_rune, sizeof(Rune))) {
+	if (view->dirty || memcmp(&rune, cached_rune, sizeof(Rune))) {
 		*cached_rune = rune;
 		rune.attr |= ATTR_DIRTY;
 	}
 
-	// For performance, we batch together stretches of runes with the same colors and attrs
-	bool diff = rune.fg != prev.fg || rune.bg != prev.bg || rune.attr != prev.attr;
+	return rune;
+}
 
-	if ((pos.x == pty.cols || diff) && (prev.attr & ATTR_DIRTY))
-		draw_text(prev, buf, pos.x - prev_pos.x, len, prev_pos);
+// Draw the dirty cells of row `y`
+static void draw_row(int y, const Rune *runes)
+{
+	u32 chars[LINE_SIZE + 1];
+	int len = 0;
+	Rune prev = runes[0];
+	int prev_x = 0;
 
-	if (pos.x == 0 || diff) {
-		len = 0;
-		prev = rune;
-		prev_pos = pos;
-	}
+	for (int x = 0; x <= view->frame.cols; ++x) {
+		Rune rune = runes[x];
 
-	bool valid_utf8 = rune.u[0] > 0xC1
-		&& ((u8) (~rune.u[0] & -rune.u[0]) || rune.u[0] + rune.u[1] & 128)
-		&& strnlen((char*) rune.u, 4) == utf_len(rune.u[0]);
+		// For performance, we batch together stretches of runes with the same colors and attrs
+		bool diff = rune.fg != prev.fg || rune.bg != prev.bg || rune.attr != prev.attr;
 
-	// Pick an appropriate rendition: NUL becomes space, invalid UTF-8 becomes ⁇
-	if (*rune.u < 0x80) {
-		buf[len++] = MAX(*rune.u, ' ');
-	} else if (!valid_utf8) {
-		memcpy(buf + len, "⁇", 3);
-		len += 3;
-	} else {
-		memcpy(buf + len, rune.u, utf_len(*rune.u));
-		len += utf_len(*rune.u);
+		if ((x == view->frame.cols || diff) && (prev.attr & ATTR_DIRTY))
+			draw_text(prev, chars, len, (Point) { prev_x, y });
+
+		if (diff) {
+			len = 0;
+			prev = rune;
+			prev_x = x;
+		}
+
+		// Pick an appropriate rendition: NUL becomes space, invalid UTF-8 becomes ⁇
+		u32 c = 0;
+		if (*rune.u < 0x80)
+			c = MAX(*rune.u, ' ');
+		else if (rune.attr & ATTR_INVALID)
+			memcpy(&c, "⁇", 3);
+		else
+			memcpy(&c, rune.u, utf_len(*rune.u));
+		chars[len++] = c;
 	}
 }
 
-// Update the display
-static void draw(void)
+// Index in `term.hist` of the cache of row `y`, which holds the cells the back buffer shows
+// on that row (it lives below the screen, out of the way)
+static int cache_index(int y)
 {
-	static int old_scroll;
+	return y + vt->term.scroll + vt->pty.rows * (1 + (vt->pty.rows - y + vt->term.lines - vt->term.scroll) / vt->pty.rows);
+}
 
-	if (term.scroll != old_scroll) {
-		int src  = MAX(term.scroll - old_scroll, 0);
-		int dest = MAX(old_scroll - term.scroll, 0);
-		int size = pty.rows - src - dest;
+// Move the cache of the rows of `move` like move_lines() moved the rows themselves (and like
+// render_frame() moves them in the back buffer)
+static void move_cache(Move move)
+{
+	int start = move.start, end = move.end, diff = move.diff;
+	int step = diff < 0 ? -1 : 1;
+	if (diff < 0)
+		SWAP(start, end);
+	int last = end - diff + step;
 
-		XCopyArea(w.disp, w.win, w.win, XDefaultGC(w.disp, w.screen),
-			0, w.font_height * src,
-			w.font_width * pty.cols, w.font_height * size,
-			0, w.font_height * dest);
-	}
+	// Copy rather than rotate: rows that nothing moved into still show the same cells
+	for (int y = start; y != last; y += step)
+		memcpy(edit_line(cache_index(y)), get_line(cache_index(y + diff)), sizeof(Rune[LINE_SIZE]));
+}
 
-	// Clear the selection if something wrote over it
-	if (sel_get_hash() != sel.hash)
-		sel.end = sel.start;
+// Copy the cells that need redrawing to `frame`, so that drawing them doesn’t need the
+// terminal anymore (see render_frame)
+static void prepare_frame(void)
+{
+	if (vt->pty.cols * w.font_width != view->buf_width || vt->pty.rows * w.font_height != view->buf_height
+			|| vt->term.reverse_video != view->shown.reverse_video)
+		view->dirty = true;
+
+	view->frame.rows = vt->pty.rows;
+	view->frame.cols = vt->pty.cols;
+	view->frame.scroll = vt->term.scroll - view->shown.scroll;
+	if (view->frame.rows > view->frame.max_rows) {
+		view->frame.runes = realloc(view->frame.runes, (size_t) view->frame.rows * sizeof *view->frame.runes);
+		if (!view->frame.runes)
+			die("Couldn't allocate the frame");
+		view->frame.max_rows = view->frame.rows;
+	}
 
-	for (int y = 0; y < pty.rows; ++y) {
-		Rune *cache_line = LINE(y + pty.rows * (1 + (pty.rows - y + term.lines - term.scroll) / pty.rows));
+	// Replay the region scrolls on the cache, and let render_frame() replay them on the back
+	// buffer: rows that only moved don't need repainting. This is only worth it (and simple)
+	// when the viewport didn't move.
+	view->frame.num_moves = 0;
+	for (int i = 0; i < vt->term.num_moves && !view->dirty && !view->frame.scroll; ++i) {
+		view->frame.moves[view->frame.num_moves++] = vt->term.moves[i];
+		move_cache(vt->term.moves[i]);
+	}
+	vt->term.num_moves = 0;
+
+	// Rows spanned by the old or new selection need redrawing when it changes
+	Point sel_start = { vt->sel.start.x, vt->sel.start.y + vt->term.scroll };
+	Point sel_end = { vt->sel.end.x, vt->sel.end.y + vt->term.scroll };
+	bool sel_changed = !POINT_EQ(sel_start, view->shown.sel_start) || !POINT_EQ(sel_end, view->shown.sel_end);
+	int sel_top = MIN(sel_start.y, view->shown.sel_start.y);
+	int sel_bot = MAX(sel_end.y, view->shown.sel_end.y);
+
+	for (int y = 0; y < vt->pty.rows; ++y) {
+		int n = y + vt->term.scroll;
+		bool *damaged = &vt->term.damage[n & (vt->term.hist_size - 1)];
+
+		// Skip lines that weren't written to, unless the cursor or selection moved over them
+		bool was_visible = BETWEEN(n, view->shown.scroll, view->shown.scroll + vt->pty.rows - 1);
+		bool overlaid = n == view->shown.cursor_y || n == vt->cursor.y + vt->term.lines || (sel_changed && BETWEEN(n, sel_top, sel_bot));
+		view->frame.redraw[y] = view->dirty || !was_visible || overlaid || (n >= vt->term.frozen && *damaged);
+		if (!view->frame.redraw[y])
+			continue;
+		if (n >= vt->term.frozen)
+			*damaged = false;
+
+		Rune *cache_line = edit_line(cache_index(y));
 
 		// The three hardest things in CS are off-by-one errors and cache invalidation
-		if (!BETWEEN(y + term.scroll, old_scroll, old_scroll + pty.rows - 1))
+		if (!was_visible)
 			memset(cache_line, 0, sizeof(Rune[LINE_SIZE]));
 
-		for (int x = 0; x <= pty.cols; ++x)
-			draw_rune((Point) { x, y }, &cache_line[x]);
+		for (int x = 0; x <= vt->pty.cols; ++x)
+			view->frame.runes[y][x] = prepare_rune((Point) { x, y }, &cache_line[x]);
 	}
 
+	view->dirty = false;
+	view->shown.scroll = vt->term.scroll;
+	view->shown.sel_start = sel_start;
+	view->shown.sel_end = sel_end;
+	view->shown.cursor_y = vt->cursor.y + vt->term.lines;
+	view->shown.reverse_video = vt->term.reverse_video;
+}
+
+// Draw the cells copied by prepare_frame() to the back buffer, then show them
+static void render_frame(void)
+{
+	// (Re)create the back buffer when the size of the grid changes
+	int width = view->frame.cols * w.font_width;
+	int height = view->frame.rows * w.font_height;
+	if (width != view->buf_width || height != view->buf_height) {
+		if (view->buf)
+			XFreePixmap(w.disp, view->buf);
+		view->buf = XCreatePixmap(w.disp, view->win, (u32) width, (u32) height,
+				(u32) DefaultDepth(w.disp, w.screen));
+		XftDrawChange(view->draw, view->buf);
+		view->buf_width = width;
+		view->buf_height = height;
+	}
+
+	if (view->frame.scroll) {
+		int src  = MAX(view->frame.scroll, 0);
+		int dest = MAX(-view->frame.scroll, 0);
+		int size = view->frame.rows - src - dest;
+
+		XCopyArea(w.disp, view->buf, view->buf, view->gc,
+			0, w.font_height * src,
+			(u32) width, (u32) (w.font_height * size),
+			0, w.font_height * dest);
+	}
+
+	// Rows to copy to the window once the frame is complete
+	int top = view->frame.scroll ? 0 : view->frame.rows;
+	int bot = view->frame.scroll ? view->frame.rows - 1 : -1;
+
+	// Region scrolls: copy the rows that stayed in the region
+	for (int i = 0; i < view->frame.num_moves; ++i) {
+		Move move = view->frame.moves[i];
+		int size = move.end - move.start + 1 - abs(move.diff);
+		if (size > 0)
+			XCopyArea(w.disp, view->buf, view->buf, view->gc,
+				0, w.font_height * (move.start + MAX(move.diff, 0)),
+				(u32) width, (u32) (w.font_height * size),
+				0, w.font_height * (move.start + MAX(-move.diff, 0)));
+		top = MIN(top, move.start);
+		bot = MAX(bot, move.end);
+	}
+
+	for (int y = 0; y < view->frame.rows; ++y) {
+		if (!view->frame.redraw[y])
+			continue;
+		draw_row(y, view->frame.runes[y]);
+		top = MIN(top, y);
+		bot = MAX(bot, y);
+	}
+
+	flush_batch();
+	if (top <= bot)
+		XCopyArea(w.disp, view->buf, view->win, view->gc, 0, top * w.font_height,
+				(u32) width, (u32) ((bot - top + 1) * w.font_height), 0, top * w.font_height);
+	u64 flush_start = TRACE_NOW();
 	XFlush(w.disp);
-	w.dirty = false;
-	old_scroll = term.scroll;
+	TRACE_SPAN("XFlush", flush_start);
 }
 
 // Print the escape sequence for special key `c`, with modifiers `state`
 static void special_key(u8 c, int state)
 {
 	if (state && c < 'A')
-		printf(CSI "%d;%d~", c, state + 1);
+		pty_printf(CSI "%d;%d~", c, state + 1);
 	else if (state)
-		printf(CSI "1;%d%c", state + 1, c);
+		pty_printf(CSI "1;%d%c", state + 1, c);
 	else if (c < 'A')
-		printf(CSI "%d~", c);
+		pty_printf(CSI "%d~", c);
 	else
-		printf("%c%c%c", ESC, term.app_keys || c > 'O' ? 'O' : '[', c);
+		pty_printf("%c%c%c", ESC, vt->term.app_keys || c > 'O' ? 'O' : '[', c);
 }
 
 // Handle keyboard shortcuts, or print the pressed key to the pty
@@ -661,6 +2106,8 @@ static void on_keypress(XKeyEvent *e)
 		45, 46, 47, 48, 49, 50, 51, 52, 53, 54, 55, 56,           // F24 - F35
 	};
 
+	view->frame.last_key = now();
+
 	bool shift = (e->state & ShiftMask) != 0;
 	bool ctrl = (e->state & ControlMask) != 0;
 	bool meta = (e->state & Mod1Mask) != 0;
@@ -669,38 +2116,38 @@ static void on_keypress(XKeyEvent *e)
 	KeySym keysym;
 	int len = XLookupString(e, buf, LEN(buf) - 1, &keysym, NULL);
 
-	if (meta && term.meta_sends_escape && len)
-		putchar(ESC);
+	if (meta && vt->term.meta_sends_escape && len)
+		pty_write("\033", 1);
 
 	if (shift && keysym == XK_Insert)
 		paste(false);
 	else if (shift && keysym == XK_Prior)
-		scroll(4 - pty.rows);
+		scroll(4 - vt->pty.rows);
 	else if (shift && keysym == XK_Next)
-		scroll(pty.rows - 4);
+		scroll(vt->pty.rows - 4);
 	else if (ctrl && shift && keysym == XK_C)
 		copy(true);
 	else if (ctrl && shift && keysym == XK_V)
 		paste(true);
 	else if (keysym == XK_ISO_Left_Tab)
-		printf(CSI "Z");
+		pty_printf(CSI "Z");
 	else if (ctrl && keysym == XK_question)
-		putchar('\177');
+		pty_write("\177", 1);
 	else if (keysym == XK_BackSpace)
-		putchar(ctrl ? '\027' : '\177');
+		pty_write(ctrl ? "\027" : "\177", 1);
 	else if (BETWEEN(keysym, 0xff50, 0xffff) && codes[keysym - 0xff50])
 		special_key(codes[keysym - 0xff50], 4 * ctrl + 2 * meta + shift);
 	else if (len)
-		write(1, buf, len);
+		pty_write(buf, len);
 }
 
-// Load the new X resources if they changed
-static void on_property_change(XPropertyEvent *e)
+// Load the new X resources if they changed (then returns true)
+static bool on_property_change(XPropertyEvent *e)
 {
 	static XrmDatabase xrm;
 
 	if (e->atom != XInternAtom(w.disp, "RESOURCE_MANAGER", false))
-		return;
+		return false;
 
 	union { Atom atom; int i; unsigned long ul; } ignored;
 	unsigned char *xprop;
@@ -715,25 +2162,29 @@ static void on_property_change(XPropertyEvent *e)
 
 	load_resources();
 
-	XWindowAttributes attrs;
-	XGetWindowAttributes(w.disp, w.parent, &attrs);
-	fix_pty_size(attrs.width, attrs.height);
+	for (View *v = views; v; v = v->next) {
+		select_view(v);
+		XWindowAttributes attrs;
+		XGetWindowAttributes(w.disp, view->parent, &attrs);
+		fix_pty_size(attrs.width, attrs.height);
+	}
+	select_view(NULL);
+	return true;
 }
 
 // Handle selection, middle-click paste, and scrolling with the wheel
 static void on_mouse(XButtonEvent *e)
 {
-	static Point prev;
 	int button = e->type == ButtonRelease ? 4 : e->button + (e->button >= Button4 ? 61 : 0);
 	Point pos = pixel2cell(e->x, e->y);
 
-	if ((e->state & Mod4Mask) || (!button && POINT_EQ(pos, prev)))
+	if ((e->state & Mod4Mask) || (!button && POINT_EQ(pos, view->pointer)))
 		return;
-	prev = pos;
+	view->pointer = pos;
 
-	if (term.report_buttons && !(e->state & ShiftMask)) {
-		if ((button || term.report_motion) && pos.x <= 222 && pos.y <= 222)
-			printf(CSI "M%c%c%c", 31 + button, 33 + pos.x, 33 + pos.y);
+	if (vt->term.report_buttons && !(e->state & ShiftMask)) {
+		if ((button || vt->term.report_motion) && pos.x <= 222 && pos.y <= 222)
+			pty_printf(CSI "M%c%c%c", 31 + button, 33 + pos.x, 33 + pos.y);
 		return;
 	}
 
@@ -743,15 +2194,15 @@ static void on_mouse(XButtonEvent *e)
 			sel_set_point(pos);
 		break;
 	case 1:  // Left click
-		sel.snap = POINT_EQ(pos, sel.mark) * sel.snap + 1 & 3;
-		sel.mark = pos;
+		vt->sel.snap = POINT_EQ(pos, vt->sel.mark) * vt->sel.snap + 1 & 3;
+		vt->sel.mark = pos;
 		sel_set_point(pos);
 		break;
 	case 2:  // Middle click
 		paste(false);
 		break;
 	case 3:  // Right click
-		sel.snap = SNAP_LINE;
+		vt->sel.snap = SNAP_LINE;
 		sel_set_point(pos);
 		break;
 	case 4:  // Any button released
@@ -764,11 +2215,52 @@ static void on_mouse(XButtonEvent *e)
 		scroll(5);
 		break;
 	}
-}
+}
+
+// Close the selected window once the main loop is done with the handlers, exiting with `status`
+// if it was the last one
+static void close_view(int status)
+{
+	view->closed = true;
+	view->status = status;
+}
+
+// Delegate to the appropriate event handler, depending on the event’s type, with the window it is
+// for selected (if it is one of ours). Returns true if the event changed what the selected window
+// shows, or every window if none is selected.
+static bool dispatch_event(XEvent *e)
+{
+	select_view(find_view(e->xany.window));
+
+	// Events that may not be about one of our windows
+	switch (e->type) {
+	case PropertyNotify:
+		// When we paste our own selection, both sides of the transfer watch the same property:
+		// new chunks are for the paste, deletions for the transfer
+		if (e->xproperty.state == PropertyNewValue && view && e->xproperty.window == view->win
+				&& e->xproperty.atom == XA_PASTE)
+			on_paste_property((XPropertyEvent*) e);
+		else if (e->xproperty.state == PropertyDelete && owned.data && e->xproperty.window == owned.requestor
+				&& e->xproperty.atom == owned.property)
+			on_transfer_property((XPropertyEvent*) e);
+		else if (!view)
+			return on_property_change((XPropertyEvent*) e);
+		return false;
+	case SelectionRequest:
+		on_selection_request((XSelectionRequestEvent*) e);
+		return false;
+	case SelectionClear:
+		on_selection_clear((XSelectionClearEvent*) e);
+		return false;
+	}
+
+	if (!view || view->closed)
+		return false;
+
+	int scroll = vt->term.scroll;
+	Point sel_start = vt->sel.start, sel_end = vt->sel.end;
+	bool focused = view->focused, dirty = view->dirty;
 
-// Delegate to the appropriate event handler, depending on the event’s type
-static void dispatch_event(XEvent *e)
-{
 	switch (e->type) {
 
 	// User input
@@ -785,84 +2277,108 @@ static void dispatch_event(XEvent *e)
 	case ConfigureNotify:
 		fix_pty_size(((XConfigureEvent*) e)->width, ((XConfigureEvent*) e)->height);
 		break;
-	case PropertyNotify:
-		on_property_change((XPropertyEvent*) e);
+	case SelectionNotify:
+		on_selection_notify((XSelectionEvent*) e);
 		break;
 	case FocusIn:
 	case FocusOut:
-		w.focused = e->type == FocusIn;
-		if (term.report_focus)
-			printf(CSI "%c", w.focused ? 'I' : 'O');
+		view->focused = e->type == FocusIn;
+		if (vt->term.report_focus)
+			pty_printf(CSI "%c", view->focused ? 'I' : 'O');
 		break;
 	case ClientMessage:
 		if ((Atom) e->xclient.data.l[0] == XA_DELETE_WINDOW)
-			exit(0);
+			close_view(0);
 		break;
-	case Expose:
-		w.dirty = true;
+	case Expose: // Copy the exposed area from the back buffer, which is always complete
+		if (view->buf)
+			XCopyArea(w.disp, view->buf, view->win, view->gc, e->xexpose.x, e->xexpose.y,
+					(u32) e->xexpose.width, (u32) e->xexpose.height, e->xexpose.x, e->xexpose.y);
 		break;
 	}
+
+	return vt->term.scroll != scroll || !POINT_EQ(vt->sel.start, sel_start) || !POINT_EQ(vt->sel.end, sel_end)
+			|| view->focused != focused || view->dirty != dirty;
 }
 
-// Fork and initialize the pty
-static void pty_new(char* cmd[])
+// Fork and initialize the pty, running `cmd` in directory `dir` (the current one if NULL)
+static void pty_new(const char *dir, char* cmd[])
 {
-	switch (forkpty(&pty.fd, 0, 0, 0)) {
+	switch (forkpty(&vt->pty.fd, 0, 0, 0)) {
 	case -1:
 		die("forkpty failed");
 	case 0:
+		// Don't pass on what the terminal set up for itself
+		signal(SIGCHLD, SIG_DFL);
+		sigset_t none;
+		sigemptyset(&none);
+		sigprocmask(SIG_SETMASK, &none, NULL);
+		if (dir && chdir(dir))
+			perror("Couldn't change directory");
 		setenv("TERM", "xterm-256color", 1);
 		execvp(cmd[0], cmd);
 		_exit(1);
 	default:
 		signal(SIGCHLD, SIG_IGN);
-		dup2(pty.fd, 1);
-		setbuf(stdout, NULL);
+		vt->out.fd = vt->pty.fd;
+		fcntl(vt->pty.fd, F_SETFL, O_NONBLOCK); // output is queued, see pty_flush()
+		fcntl(vt->pty.fd, F_SETFD, FD_CLOEXEC); // the other windows' applications mustn't keep it open
 	}
 }
 
-// Read one character from the pty, blocking if necessary
-static u8 pty_getchar(void)
+// Read whatever input is available from the pty into its buffer (blocks if there is none),
+// without handing it to the parser yet. Returns -1 once the application is gone, or with THREADS,
+// once the window is closed.
+static long pty_fill(void)
 {
-	if (pty.c >= pty.end) {
-#ifdef HEADLESS
-		if (pty.c)
-			return '\a';
+	long result;
+	while ((result = read(vt->pty.fd, vt->pty.buf, BUFSIZ)) < 0 && errno == EAGAIN) {
+#ifdef THREADS
+		// The main loop closes its end of `wake` to stop the parser thread
+		struct pollfd fds[] = { { vt->pty.fd, POLLIN, 0 }, { vt->pty.wake[1], 0, 0 } };
+		if (poll(fds, 2, -1) > 0 && fds[1].revents)
+			return -1;
+#else
+		poll(&(struct pollfd) { vt->pty.fd, POLLIN, 0 }, 1, -1);
 #endif
-		pty.c = pty.buf;
-		long result = read(pty.fd, pty.buf, BUFSIZ);
-		if (result < 0)
-			exit(!pty.end);
-		pty.end = pty.buf + result;
 	}
+	return result > 0 ? result : -1;
+}
 
-	return *pty.c++;
+// Hand the `len` bytes just read to the parser (with THREADS, only under the lock: run() polls them)
+static void pty_start(long len)
+{
+	vt->pty.c = vt->pty.buf;
+	vt->pty.end = vt->pty.buf + len;
+	++vt->stats.reads;
+	vt->stats.full_reads += len == BUFSIZ;
+	vt->stats.bytes += (u64) len;
 }
 
 // Set the graphical attributes of future text based on the parameter `**p`
 static int* set_attr(int *attr)
 {
-	u8 *color = &cursor.rune.fg;
+	u8 *color = &vt->cursor.rune.fg;
 	if (BETWEEN(*attr, 40, 49) || BETWEEN(*attr, 100, 107)) {
-		color = &cursor.rune.bg;
+		color = &vt->cursor.rune.bg;
 		*attr -= 10;
 	}
 
 	switch (*attr) {
 	case 0:
-		zeromem(cursor.rune);
+		zeromem(vt->cursor.rune);
 		break;
 	case 1 ... 9:
-		cursor.rune.attr |= 1 << *attr;
+		vt->cursor.rune.attr |= 1 << *attr;
 		break;
 	case 21:
-		cursor.rune.attr |= ATTR_UNDERLINE;
+		vt->cursor.rune.attr |= ATTR_UNDERLINE;
 		break;
 	case 22:
-		cursor.rune.attr &= ~(ATTR_BOLD | ATTR_FAINT);
+		vt->cursor.rune.attr &= ~(ATTR_BOLD | ATTR_FAINT);
 		break;
 	case 23 ... 29:
-		cursor.rune.attr &= ~(1 << (*attr - 20));
+		vt->cursor.rune.attr &= ~(1 << (*attr - 20));
 		break;
 	case 30:
 		*color = 232;
@@ -896,88 +2412,98 @@ static void set_mode(bool set, int mode)
 {
 	switch (mode) {
 	case 1:    // DECCKM — Application cursor keys
-		term.app_keys = set;
+		vt->term.app_keys = set;
 		break;
 	case 5:    // DECSCNM — Reverse video
-		term.reverse_video = set;
+		vt->term.reverse_video = set;
 		break;
 	case 25:   // DECTCEM — Show cursor
-		term.hide = !set;
+		vt->term.hide = !set;
 		break;
 	case 47:
 	case 1049: // Alternate screen buffer
-		term.lines += (set - term.alt) * pty.rows;
-		term.scroll = term.lines;
+		vt->term.lines += (set - vt->term.alt) * vt->pty.rows;
+		vt->term.scroll = vt->term.lines;
+		sel_clear(); // the rows it covered now show the other screen
 		if (set)
-			erase_lines(0, pty.rows);
+			erase_lines(0, vt->pty.rows);
 		else
-			cursor = saved_cursors[0];
-		saved_cursors[term.alt] = cursor;
-		term.alt = set;
+			vt->cursor = vt->saved_cursors[0];
+		vt->saved_cursors[vt->term.alt] = vt->cursor;
+		vt->term.alt = set;
+		hist_fit();
 		break;
 	case 1000: // Report mouse buttons
 	case 1003: // Report mouse motion
-		term.report_buttons = set;
-		term.report_motion = mode == 1003 && set;
+		vt->term.report_buttons = set;
+		vt->term.report_motion = mode == 1003 && set;
 		break;
 	case 1004: // Report focus events
-		term.report_focus = set;
+		vt->term.report_focus = set;
 		break;
 	case 1036: // Send ESC when Meta modifies a key
-		term.meta_sends_escape = set;
+		vt->term.meta_sends_escape = set;
 		break;
 	case 2004: // Send special sequences before/after each paste
-		term.bracketed_paste = set;
+		vt->term.bracketed_paste = set;
+		break;
+	case 2026: // Synchronized output: don't draw partial updates (see run())
+		vt->term.sync_until = set ? now() + SYNC_TIMEOUT : 0;
 		break;
 	}
 }
 
-// Parse and interpret a control sequence started by CSI (ESC [)
-static void handle_csi()
+// Get the state of mode `mode` for DECRQM: 1 if set, 2 if reset, 0 if unsupported
+static int get_mode(int mode)
 {
-	int arg[32] = { 0, 0 };
-	int *last_arg = arg;
-	u8 extra = 0;
-	u8 c = pty_getchar();
-
-	for (; BETWEEN(c, '<', '?'); c = pty_getchar())
-		extra = extra ? 1 : c;
-
-	for (; BETWEEN(c, '0', ';'); c = pty_getchar())
-		if (c > '9')
-			++last_arg;
-		else if (last_arg < arg + LEN(arg) && *last_arg < 5000)
-			*last_arg = *last_arg * 10 + c - '0';
-	last_arg = MIN(last_arg, arg + LEN(arg) - 5);
+	switch (mode) {
+	case 1:    return 2 - vt->term.app_keys;
+	case 5:    return 2 - vt->term.reverse_video;
+	case 25:   return 1 + vt->term.hide;
+	case 47:
+	case 1049: return 2 - vt->term.alt;
+	case 1000: return 2 - vt->term.report_buttons;
+	case 1003: return 2 - vt->term.report_motion;
+	case 1004: return 2 - vt->term.report_focus;
+	case 1036: return 2 - vt->term.meta_sends_escape;
+	case 2004: return 2 - vt->term.bracketed_paste;
+	case 2026: return 2 - !!vt->term.sync_until;
+	default:   return 0;
+	}
+}
 
-	for (; BETWEEN(c, ' ', '?'); c = pty_getchar())
-		extra = extra || c > '/' ? 1 : c;
+// Interpret a control sequence started by CSI (ESC [), once its final byte `c` is received
+static void handle_csi(u8 c)
+{
+	int *arg = vt->parser.arg;
+	int *last_arg = arg + MIN(vt->parser.num_args, (int) LEN(vt->parser.arg) - 5);
+	int extra = vt->parser.extra;
 
 	switch (extra << 8 | c) {
 	case 'A': // CUU — Cursor <n> up
-		move_to(cursor.x, cursor.y - MAX(*arg, 1));
+		move_to(vt->cursor.x, vt->cursor.y - MAX(*arg, 1));
 		break;
 	case 'B': // CUD — Cursor <n> down
 	case 'e': // VPR — Cursor <n> down
-		move_to(cursor.x, cursor.y + MAX(*arg, 1));
+		move_to(vt->cursor.x, vt->cursor.y + MAX(*arg, 1));
 		break;
 	case 'C': // CUF — Cursor <n> forward
 	case 'a': // HPR — Cursor <n> forward
-		move_to(cursor.x + MAX(*arg, 1), cursor.y);
+		move_to(vt->cursor.x + MAX(*arg, 1), vt->cursor.y);
 		break;
 	case 'D': // CUB — Cursor <n> backward
-		LIMIT(cursor.x, 0, pty.cols - 1);
-		move_to(cursor.x - MAX(*arg, 1), cursor.y);
+		LIMIT(vt->cursor.x, 0, vt->pty.cols - 1);
+		move_to(vt->cursor.x - MAX(*arg, 1), vt->cursor.y);
 		break;
 	case 'E': // CNL — Cursor <n> down and first col
-		move_to(0, cursor.y + MAX(*arg, 1));
+		move_to(0, vt->cursor.y + MAX(*arg, 1));
 		break;
 	case 'F': // CPL — Cursor <n> up and first col
-		move_to(0, cursor.y - MAX(*arg, 1));
+		move_to(0, vt->cursor.y - MAX(*arg, 1));
 		break;
 	case 'G': // CHA — Move to <col>
 	case '`': // HPA — Move to <col>
-		move_to(*arg - 1, cursor.y);
+		move_to(*arg - 1, vt->cursor.y);
 		break;
 	case 'H': // CUP — Move to <row> <col>
 	case 'f': // HVP — Move to <row> <col>
@@ -985,288 +2511,1141 @@ static void handle_csi()
 		break;
 	case 'I': // CHT — Cursor forward <n> tabulation stops
 		*arg = MAX(*arg, 1);
-		while (cursor.x < pty.cols - 1 && (*arg -= term.tabs[++cursor.x]));
+		while (vt->cursor.x < vt->pty.cols - 1 && (*arg -= vt->term.tabs[++vt->cursor.x]));
 		break;
 	case '?J':
 	case 'J': // ED — Erase display
-		erase_lines(*arg ? 0 : cursor.y + 1, *arg == 1 ? cursor.y : pty.rows);
+		if (*arg == 3) { // Erase saved lines, releasing their memory
+			if (vt->sel.start.y < vt->term.frozen - vt->term.scroll)
+				sel_clear();
+			cold_resize(0);
+			vt->term.hist_start = vt->term.frozen;
+			break;
+		}
+		erase_lines(*arg ? 0 : vt->cursor.y + 1, *arg == 1 ? vt->cursor.y : vt->pty.rows);
 		__attribute__((fallthrough));
 	case '?K':
 	case 'K': // EL — Erase line
-		erase_chars(cursor.y, *arg ? 0 : cursor.x, *arg == 1 ? cursor.x + 1 : pty.cols);
+		erase_chars(vt->cursor.y, *arg ? 0 : vt->cursor.x, *arg == 1 ? vt->cursor.x + 1 : vt->pty.cols);
 		break;
 	case 'L': // IL — Insert <n> blank lines
 	case 'M': // DL — Delete <n> lines
-		if (BETWEEN(cursor.y, term.top, term.bot)) {
-			LIMIT(*arg, 1, term.bot - cursor.y + 1);
-			move_lines(cursor.y, term.bot, c == 'L' ? -*arg : *arg);
-			cursor.x = 0;
+		if (BETWEEN(vt->cursor.y, vt->term.top, vt->term.bot)) {
+			LIMIT(*arg, 1, vt->term.bot - vt->cursor.y + 1);
+			move_lines(vt->cursor.y, vt->term.bot, c == 'L' ? -*arg : *arg);
+			vt->cursor.x = 0;
 		}
 		break;
 	case '@': // ICH — Insert <n> spaces
 	case 'P': // DCH — Delete <n> chars
-		LIMIT(*arg, 1, pty.cols - cursor.x);
-		LIMIT(cursor.x, 0, pty.cols - 1);
-		move_chars(cursor.x, pty.cols, c == '@' ? -*arg : *arg);
+		LIMIT(*arg, 1, vt->pty.cols - vt->cursor.x);
+		LIMIT(vt->cursor.x, 0, vt->pty.cols - 1);
+		move_chars(vt->cursor.x, vt->pty.cols, c == '@' ? -*arg : *arg);
 		break;
 	case 'S': // SU — Scroll <n> lines up
 	case 'T': // SD — Scroll <n> lines down
-		LIMIT(*arg, 1, term.bot - term.top + 1);
-		move_lines(term.top, term.bot, c == 'T' ? -*arg : *arg);
+		LIMIT(*arg, 1, vt->term.bot - vt->term.top + 1);
+		move_lines(vt->term.top, vt->term.bot, c == 'T' ? -*arg : *arg);
 		break;
 	case 'X': // ECH — Erase <n> chars
-		LIMIT(*arg, 1, pty.cols - cursor.x);
-		erase_chars(cursor.y, cursor.x, cursor.x + *arg);
+		LIMIT(*arg, 1, vt->pty.cols - vt->cursor.x);
+		erase_chars(vt->cursor.y, vt->cursor.x, vt->cursor.x + *arg);
 		break;
 	case 'Z': // CBT — Cursor backward <n> tabulation stops
 		*arg = MAX(*arg, 1);
-		while (BETWEEN(cursor.x, 1, pty.cols -1) && (*arg -= term.tabs[--cursor.x]));
+		while (BETWEEN(vt->cursor.x, 1, vt->pty.cols -1) && (*arg -= vt->term.tabs[--vt->cursor.x]));
 		break;
 	case 'c':  // DA — Device Attributes
 	case '>c': // Secondary DA
 		if (*arg == 0)
-			printf(extra ? CSI ">1;0;0c" : CSI "?62;15;22c");
+			pty_printf(extra ? CSI ">1;0;0c" : CSI "?62;15;22c");
 		break;
 	case 'd': // VPA — Move to <row>
-		move_to(cursor.x, *arg - 1);
+		move_to(vt->cursor.x, *arg - 1);
 		break;
 	case 'g': // TBC — Tabulation Clear
 		if (*arg == 0)
-			term.tabs[cursor.x] = false;
+			vt->term.tabs[vt->cursor.x] = false;
 		else if (*arg == 3)
-			zeromem(term.tabs);
+			zeromem(vt->term.tabs);
 		break;
 	case '?h': // SM — Set Mode
 	case '?l': // RM — Reset Mode
 		for (int *p = arg; p <= last_arg; ++p)
 			set_mode(c == 'h', *p);
 		break;
+	case '?$p': // DECRQM — Request Mode
+		pty_printf(CSI "?%d;%d$y", *arg, get_mode(*arg));
+		break;
+	case '$p': // DECRQM — Request Mode (ANSI modes, none of which are supported)
+		pty_printf(CSI "%d;0$y", *arg);
+		break;
 	case 'm': // SGR — Select Graphic Rendition
 		for (int *p = arg; p <= last_arg; p = set_attr(p));
 		break;
 	case 'n': // DSR – Device Status Report (cursor position)
 		if (*arg == 5)
-			printf(CSI "0n");
+			pty_printf(CSI "0n");
 		else if (*arg == 6)
-			printf(CSI "%i;%iR", cursor.y + 1, cursor.x + 1);
+			pty_printf(CSI "%i;%iR", vt->cursor.y + 1, vt->cursor.x + 1);
 		break;
 	case ' q': // DECSCUSR — Set Cursor Style
 		if (*arg <= 6)
-			term.cursor_style = *arg;
+			vt->term.cursor_style = *arg;
 		break;
 	case 'r': // DECSTBM — Set Scrolling Region
 		arg[0] = arg[0] ? arg[0] : 1;
-		arg[1] = arg[1] && arg[1] < pty.rows ? arg[1] : pty.rows;
+		arg[1] = arg[1] && arg[1] < vt->pty.rows ? arg[1] : vt->pty.rows;
 		if (arg[0] < arg[1]) {
-			term.top = arg[0] - 1;
-			term.bot = arg[1] - 1;
+			vt->term.top = arg[0] - 1;
+			vt->term.bot = arg[1] - 1;
 			move_to(0, 0);
 		}
 		break;
 	case 's': // DECSC — Save Cursor
-		saved_cursors[term.alt] = cursor;
+		vt->saved_cursors[vt->term.alt] = vt->cursor;
 		break;
 	case 'u': // DECRC — Restore Cursor
-		cursor = saved_cursors[term.alt];
+		vt->cursor = vt->saved_cursors[vt->term.alt];
 		break;
 	}
 }
 
-// Parse and interpret a control sequence started by OSC (ESC ])
-static bool handle_osc()
-{
-	if (pty_getchar() != '2')
-		return false;
-	if (pty_getchar() != ';')
-		return false;
-
-	char title[32] = "";
-	int i = 0;
-
-	while (1) {
-		char c = pty_getchar();
-		if (c == ESC || c == '\a')
-			break;
-		if (i < 31)
-			title[i++] = c;
-	}
-
-	return true;
-}
-
-// Interpret an escape sequence started by an ESC byte
-static void handle_esc(u8 second_byte)
+// Interpret an escape sequence started by an ESC byte, once its final byte is received
+static void handle_esc(u8 second_byte, u8 final_byte)
 {
-	u8 final_byte = second_byte;
-	while (BETWEEN(final_byte, ' ', '/'))
-		final_byte = pty_getchar();
-
 	switch (second_byte) {
 	case '(' ... '+':
 		if (strchr("0<>AB", final_byte))
-			term.charsets[second_byte - '('] = final_byte % ESC & 3;
+			vt->term.charsets[second_byte - '('] = final_byte % ESC & 3;
 		break;
 	case '7': // DECSC — Save Cursor
-		saved_cursors[term.alt] = cursor;
+		vt->saved_cursors[vt->term.alt] = vt->cursor;
 		break;
 	case '8': // DECRC — Restore Cursor
-		cursor = saved_cursors[term.alt];
+		vt->cursor = vt->saved_cursors[vt->term.alt];
 		break;
 	case 'E': // NEL — Next line
 		newline();
-		cursor.x = 0;
+		vt->cursor.x = 0;
 		break;
 	case 'H': // HTS — Tab Set
-		term.tabs[cursor.x] = true;
+		vt->term.tabs[vt->cursor.x] = true;
 		break;
 	case 'M': // RI — Reverse index
-		if (cursor.y <= term.top)
-			move_lines(term.top, term.bot, -1);
+		if (vt->cursor.y <= vt->term.top)
+			move_lines(vt->term.top, vt->term.bot, -1);
 		else
-			--cursor.y;
+			--vt->cursor.y;
 		break;
 	case 'V':
-		term.guarded = true;
-		cursor.rune.attr |= ATTR_GUARDED;
+		vt->term.guarded = true;
+		vt->cursor.rune.attr |= ATTR_GUARDED;
 		break;
 	case 'W':
-		cursor.rune.attr &= ~ATTR_GUARDED;
-		break;
-	case ']': // OSC — Operating System Command
-		if (handle_osc())
-			break;
-		__attribute__((fallthrough));
-	case 'P': // DCS — Device Control String
-	case 'X': // SOS — Start of String
-	case '^': // PM — Privacy Message
-	case '_': // APC — Application Program Command
-		while (final_byte != ESC && final_byte != '\a')
-			final_byte = pty_getchar();
-		if (final_byte == ESC)
-			handle_esc(pty_getchar());
-		break;
-	case '[': // CSI — Control Sequence Introducer
-		handle_csi();
+		vt->cursor.rune.attr &= ~ATTR_GUARDED;
 		break;
 	case 'c': // RIS — Reset to inital state
-		zeromem(term);
-		zeromem(cursor);
-		zeromem(saved_cursors);
+		zeromem(vt->parser);
+		sel_clear();
+		cold_resize(0);
+		hist_resize(0);
+		vt->term = (__typeof(vt->term)) { .save_lines = vt->term.save_lines };
+		zeromem(vt->cursor);
+		zeromem(vt->saved_cursors);
 		term_init();
 		break;
 	case 'n': // Invoke the G2 character set
 	case 'o': // Invoke the G3 character set
-		term.charset = second_byte - 'n' + 2;
+		vt->term.charset = second_byte - 'n' + 2;
 		break;
 	}
 }
 
-// Handle input from the pty: interpret control characters, parse and save utf-8
-static void handle_input(u8 u)
+// Write `len` printable ASCII chars at the cursor position, without wrapping
+static void put_ascii(const u8 *text, int len)
+{
+	Rune *rune = &EDIT_LINE(vt->cursor.y)[vt->cursor.x];
+	u8 charset = vt->term.charsets[vt->term.charset];
+
+	for (int i = 0; i < len; ++i) {
+		rune[i] = vt->cursor.rune;
+		if (charset) {
+			const u8 *p = charsets[charset - 1] + 4 * (text[i] - ' ');
+			memcpy(rune + i, p, utf_len(*p));
+		} else {
+			rune[i].u[0] = text[i];
+		}
+	}
+
+	vt->cursor.x += len;
+	vt->stats.cells += (u64) len;
+}
+
+// Interpret a C0 control character
+static void handle_control(u8 c)
 {
-invalid_utf8:
-	switch (u) {
+	switch (c) {
 	case '\b':
-		move_to(cursor.x - 1, cursor.y);
-		return;
+		move_to(vt->cursor.x - 1, vt->cursor.y);
+		break;
 	case '\t':
-		while (cursor.x < pty.cols - 1 && !term.tabs[++cursor.x]);
-		return;
+		while (vt->cursor.x < vt->pty.cols - 1 && !vt->term.tabs[++vt->cursor.x]);
+		break;
 	case '\n' ... '\f':
 		newline();
-		return;
+		break;
 	case '\r':
-		cursor.x = 0;
-		return;
+		vt->cursor.x = 0;
+		break;
 	case '\016': // LS1 — Locking shift 1
 	case '\017': // LS0 — Locking shift 0
-		term.charset = u == '\016';
-		return;
-	case ESC:
-		handle_esc(pty_getchar());
+		vt->term.charset = c == '\016';
+		break;
+	}
+}
+
+// Print the char `u` at the cursor position, parsing UTF-8
+static void handle_text(u8 u)
+{
+	if (vt->cursor.x == vt->pty.cols) {
+		newline();
+		vt->cursor.x = 0;
+	}
+
+	if (u <= '~') {
+		// Fast path: copy the rest of the printable run in one go, up to the right margin
+		put_ascii(&u, 1);
+		int len = (int) MIN(ascii_run((const u8*) vt->pty.c, (const u8*) vt->pty.end), vt->pty.cols - vt->cursor.x);
+		put_ascii((const u8*) vt->pty.c, len);
+		vt->pty.c += len;
 		return;
-	case ' ' ... '~':
-	case 128 ... 255:
-		if (cursor.x == pty.cols) {
-			newline();
-			cursor.x = 0;
+	}
+
+	// The rune is marked invalid until the decoder accepts the whole sequence
+	Rune *rune = &EDIT_LINE(vt->cursor.y)[vt->cursor.x++];
+	*rune = vt->cursor.rune;
+	rune->u[0] = u;
+	rune->attr |= ATTR_INVALID;
+	u8 state = utf8_dfa[256 + utf8_dfa[u]];
+	vt->term.utf8_state = state == UTF8_REJECT ? UTF8_ACCEPT : state;
+	vt->term.utf8_len = 1;
+	++vt->stats.cells;
+}
+
+// Handle one byte of input from the pty. This never blocks: the state of the parser is
+// kept in `parser`, so sequences split across reads are simply resumed with the next byte
+static void handle_input(u8 u)
+{
+	// Continuation of the last rune: the decoder state survives across reads
+	if (vt->term.utf8_state != UTF8_ACCEPT) {
+		u8 state = utf8_dfa[256 + vt->term.utf8_state + utf8_dfa[u]];
+		if (state != UTF8_REJECT && vt->cursor.x > 0) {
+			Rune *rune = &EDIT_LINE(vt->cursor.y)[vt->cursor.x - 1];
+			rune->u[vt->term.utf8_len++] = u;
+			if (state == UTF8_ACCEPT)
+				rune->attr &= ~ATTR_INVALID;
+			vt->term.utf8_state = state;
+			return;
 		}
+		// Truncated sequence: the rune stays invalid, and `u` starts afresh
+		vt->term.utf8_state = UTF8_ACCEPT;
+	}
+
+	u8 class = byte_class[u];
 
-		cursor.rune.u[0] = u;
-		Rune *rune = &LINE(cursor.y)[cursor.x];
-		*rune = cursor.rune;
-		++cursor.x;
+	// As on a VT500, control chars are executed even in the middle of a sequence
+	if (class == CLASS_ESC) {
+		vt->parser.state = ESCAPE;
+		return;
+	} else if (class == CLASS_CANCEL) {
+		vt->parser.state = GROUND;
+		return;
+	} else if (class == CLASS_C0 && vt->parser.state != STRING) {
+		++vt->stats.controls;
+		handle_control(u);
+		return;
+	} else if (class == CLASS_DEL) {
+		return;
+	}
 
-		for (long i = 1, len = utf_len(u); i < len; ++i) {
-			u = pty_getchar();
-			if (!BETWEEN(u, 128, 191))
-				goto invalid_utf8;
-			rune->u[i & 3] = u;
+	switch (vt->parser.state) {
+	case GROUND:
+		handle_text(u);
+		break;
+	case ESCAPE:
+		vt->parser.second_byte = u;
+		if (class == CLASS_INTER) {
+			vt->parser.state = ESCAPE_INTER;
+		} else if (u == '[') { // CSI — Control Sequence Introducer
+			zeromem(vt->parser.arg);
+			vt->parser.num_args = vt->parser.extra = 0;
+			vt->parser.state = CSI_ENTRY;
+		} else if (strchr("]PX^_", u)) { // OSC, DCS, SOS, PM, APC: ignored
+			++vt->stats.strings;
+			vt->parser.state = STRING;
+		} else {
+			vt->parser.state = GROUND;
+			if (class != CLASS_HIGH) {
+				++vt->stats.escapes[u];
+				handle_esc(u, u);
+			}
+		}
+		break;
+	case ESCAPE_INTER:
+		if (class != CLASS_INTER) {
+			vt->parser.state = GROUND;
+			if (class != CLASS_HIGH) {
+				++vt->stats.escapes[u];
+				handle_esc(vt->parser.second_byte, u);
+			}
+		}
+		break;
+	case CSI_ENTRY:
+		if (class == CLASS_PRIVATE) {
+			vt->parser.extra = vt->parser.extra ? 1 : u;
+			break;
+		}
+		vt->parser.state = CSI_PARAM;
+		__attribute__((fallthrough));
+	case CSI_PARAM:
+		if (u == ':' || u == ';') {
+			++vt->parser.num_args;
+			break;
+		} else if (class == CLASS_PARAM) {
+			int *arg = vt->parser.arg + vt->parser.num_args;
+			if (vt->parser.num_args < (int) LEN(vt->parser.arg) && *arg < 5000)
+				*arg = *arg * 10 + u - '0';
+			break;
 		}
+		vt->parser.state = CSI_INTER;
+		__attribute__((fallthrough));
+	case CSI_INTER:
+		if (class == CLASS_INTER || class == CLASS_PARAM || class == CLASS_PRIVATE) {
+			vt->parser.extra = vt->parser.extra > 0xff || u > '/' ? 1 : (u16) (vt->parser.extra << 8 | u);
+		} else {
+			vt->parser.state = GROUND;
+			if (class == CLASS_FINAL) {
+				++vt->stats.csis[u];
+				handle_csi(u);
+			}
+		}
+		break;
+	case STRING:
+		if (u == '\a')
+			vt->parser.state = GROUND;
+		break;
+	}
+}
+
+// Create a terminal of `rows` × `cols` keeping up to `save_lines` lines of history, which
+// writes its replies to queries to `fd` (or drops them if `fd` is negative)
+static Terminal *term_new(int rows, int cols, int save_lines, int fd)
+{
+	Terminal *caller = vt;
+	if (!(vt = calloc(1, sizeof(Terminal))))
+		die("Couldn't allocate the terminal");
+	vt->pty.fd = -1;
+	vt->pty.rows = LIMIT(rows, 1, MAX_ROWS);
+	vt->pty.cols = LIMIT(cols, 1, LINE_SIZE - 1);
+	vt->out.fd = fd;
+	vt->term.save_lines = MAX(save_lines, 0);
+	handle_esc('c', 'c');
+	Terminal *t = vt;
+	vt = caller;
+	return t;
+}
+
+#ifdef HEADLESS
+// Parse `len` bytes of output of the application running in `t` (the X front end reads the pty
+// and parses it in slices itself)
+static void term_feed(Terminal *t, const char *data, long len)
+{
+	Terminal *caller = vt;
+	vt = t;
+	vt->stats.bytes += (u64) len;
+	for (vt->pty.c = data, vt->pty.end = data + len; vt->pty.c < vt->pty.end;)
+		handle_input(*vt->pty.c++); // may consume a run of text past `pty.c` at once
+	vt->pty.c = vt->pty.end = vt->pty.buf;
+	pty_flush();
+	vt = caller;
+}
+
+// Get the cell at column `x` of row `y` of the screen of `t` (negative rows are in the history)
+static Rune term_cell(Terminal *t, int x, int y)
+{
+	if (x < 0 || x >= t->pty.cols || y < t->term.hist_start - t->term.lines || y >= t->pty.rows)
+		return (Rune) {0};
+	Terminal *caller = vt;
+	vt = t;
+	Rune cell = get_line(y + t->term.lines)[x];
+	vt = caller;
+	return cell;
+}
+#endif
+
+// Wake up the main loop at `deadline`
+static void arm_timer(u64 deadline)
+{
+	// A zero expiration would disarm the timer
+	struct itimerspec timer = { { 0, 0 }, { (time_t) (deadline / 1000000000), MAX((long) (deadline % 1000000000), 1) } };
+	timerfd_settime(view->timer, TFD_TIMER_ABSTIME, &timer, NULL);
+}
+
+// Schedule a frame: right away in LATENCY mode, or capped by the frame rate in THROUGHPUT mode
+static void schedule(int mode)
+{
+	u64 deadline = mode == LATENCY ? now() : view->frame.last_draw + view->frame.interval;
+	if (view->frame.mode == IDLE || deadline < view->frame.deadline)
+		arm_timer(view->frame.deadline = deadline);
+	if (view->frame.mode != LATENCY)
+		view->frame.mode = mode;
+}
+
+// Schedule a frame after reading from the pty
+static void schedule_output(u64 time)
+{
+	view->frame.bytes += (u64) (vt->pty.end - vt->pty.buf);
+
+	// A short read soon after a keypress is most likely an echo: show it immediately.
+	// Otherwise keep parsing until the frame rate allows drawing again.
+	bool flood = vt->pty.end - vt->pty.buf == LEN(vt->pty.buf);
+	schedule(!flood && time - view->frame.last_key < ECHO_DELAY ? LATENCY : THROUGHPUT);
+}
+
+// Draw a frame, and report how long it took along with the parsing that preceded it.
+// Only taking the snapshot needs the lock: the parser can go on while we render it.
+static void draw_frame(void)
+{
+	u64 start = now();
+	LOCK();
+	prepare_frame();
+	int mode = view->frame.mode;
+	u64 bytes = view->frame.bytes, parse_time = view->frame.parse_time, last_draw = view->frame.last_draw;
+	view->frame.last_draw = start;
+	view->frame.mode = IDLE;
+	view->frame.held = false;
+	view->frame.bytes = view->frame.parse_time = 0;
+	UNLOCK();
+	TRACE_SPAN("prepare", start);
+
+	u64 cells = perf.cells;
+	u64 render_start = TRACE_NOW();
+	render_frame();
+	u64 end = now();
+	TRACE_SPAN("render", render_start);
+	TRACE_SPAN("draw", start);
+	++perf.frames;
+	perf.max_cells = MAX(perf.max_cells, perf.cells - cells);
+	perf.parse_time += parse_time;
+	perf.draw_time += end - start;
+
+	if (view->frame.show_timings && !last_draw)
+		fprintf(stderr, "startup: connected to X after %.3f ms, configured after %.3f ms (%.3f ms opening fonts), "
+				"command started after %.3f ms, first frame drawn after %.3f ms\n",
+				(double) (startup.connected - startup.start) / 1e6, (double) (startup.configured - startup.start) / 1e6,
+				(double) startup.fonts / 1e6, (double) (startup.spawned - startup.start) / 1e6,
+				(double) (end - startup.start) / 1e6);
+	if (view->frame.show_timings)
+		fprintf(stderr, "%s frame: %llu bytes parsed in %.3f ms, drawn in %.3f ms, %.3f ms after the last one\n",
+				mode == LATENCY ? "latency" : "throughput", (unsigned long long) bytes,
+				(double) parse_time / 1e6, (double) (end - start) / 1e6,
+				(double) (start - last_draw) / 1e6);
+}
+
+// Print the nonzero `counts` of escape sequences by final byte, most frequent first
+static void dump_finals(FILE *f, const char *label, const u64 counts[128])
+{
+	u64 done[128] = {0};
+	bool any = false;
+	fprintf(f, "    %s by final byte:", label);
+	for (;;) {
+		int max = 0;
+		for (int c = 1; c < 128; ++c)
+			if (counts[c] - done[c] > counts[max] - done[max])
+				max = c;
+		if (counts[max] == done[max])
+			break;
+		fprintf(f, "%s %c %llu", any ? "," : "", max, (unsigned long long) counts[max]);
+		done[max] = counts[max];
+		any = true;
+	}
+	fprintf(f, "%s\n", any ? "" : " none");
+}
+
+// Report the performance counters on stderr, or append them to the file named by the statsFile
+// resource. Compare the time spent parsing, drawing and waiting to tell a flooded parser from a
+// slow renderer or X server.
+static void dump_stats(void)
+{
+	typedef unsigned long long ull;
+	const char *path = get_resource("statsFile", NULL);
+	FILE *f = path ? fopen(path, "a") : stderr;
+	if (!f) {
+		perror(path);
+		return;
+	}
 
-		if (term.charsets[term.charset] && u <= '~') {
-			const u8 *p = charsets[term.charsets[term.charset] - 1] + 4 * (u - ' ');
-			memcpy(rune, p, utf_len(*p));
+	fprintf(f, "vvvvvt %d after %.3f s:\n", (int) getpid(), (double) (now() - startup.start) / 1e9);
+	for (View *v = views; v; v = v->next) {
+		const Terminal *t = v->vt;
+		if (views->next)
+			fprintf(f, "  window 0x%lx:\n", v->win);
+		fprintf(f, "  pty: %llu bytes in %llu reads (%.1f bytes per read, %llu full), %llu parsed\n",
+				(ull) t->stats.bytes, (ull) t->stats.reads, (double) t->stats.bytes / (double) MAX(t->stats.reads, 1),
+				(ull) t->stats.full_reads, (ull) t->stats.bytes - (ull) (t->pty.end - t->pty.c));
+		u64 escapes = 0, csis = 0;
+		for (int c = 0; c < 128; ++c) {
+			escapes += t->stats.escapes[c];
+			csis += t->stats.csis[c];
 		}
+		fprintf(f, "  parser: %llu control chars, %llu escape sequences, %llu CSI sequences, %llu strings, "
+				"%llu cells written\n", (ull) t->stats.controls, (ull) escapes, (ull) csis,
+				(ull) t->stats.strings, (ull) t->stats.cells);
+		dump_finals(f, "escape sequences", t->stats.escapes);
+		dump_finals(f, "CSI sequences", t->stats.csis);
+	}
+	fprintf(f, "  renderer: %llu frames, %llu cells redrawn (%.1f per frame, at most %llu), "
+			"%llu calls to draw_text(), %lu X requests\n", (ull) perf.frames, (ull) perf.cells,
+			(double) perf.cells / (double) MAX(perf.frames, 1), (ull) perf.max_cells,
+			(ull) perf.draw_calls, XNextRequest(w.disp) - 1);
+	fprintf(f, "  time: %.3f ms parsing, %.3f ms drawing, %.3f ms waiting for events\n",
+			(double) perf.parse_time / 1e6, (double) perf.draw_time / 1e6, (double) perf.wait_time / 1e6);
+	if (f != stderr)
+		fclose(f);
+}
+
+#ifdef TRACE
+// Write the recorded spans in the Chrome trace format to a new file, named by the traceFile resource
+// or else vvvvvt-PID-N.json (for the Nth trace) in $XDG_RUNTIME_DIR or the working directory.
+// Existing files and symlinks are left alone.
+static void write_trace(void)
+{
+	static int traces;
+	char path[PATH_MAX];
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	snprintf(path, sizeof(path), "%s%svvvvvt-%d-%d.json", dir ? dir : "", dir ? "/" : "", (int) getpid(), ++traces);
+	const char *name = get_resource("traceFile", path);
+
+	int fd = open(name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+	FILE *f = fd < 0 ? NULL : fdopen(fd, "w");
+	if (!f) {
+		perror(name);
+		if (fd >= 0)
+			close(fd);
+		return;
 	}
+
+	u64 count = __atomic_load_n(&trace.count, __ATOMIC_RELAXED);
+	u64 first = count > LEN(trace.spans) ? count - LEN(trace.spans) : 0;
+	fprintf(f, "{\"traceEvents\": [\n");
+	for (u64 i = first; i < count; ++i) {
+		__typeof(*trace.spans) *span = &trace.spans[i & (LEN(trace.spans) - 1)];
+		fprintf(f, "%s{\"name\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": %d}\n",
+				i > first ? "," : "", span->name, (double) (span->start - startup.start) / 1e3,
+				(double) (span->end - span->start) / 1e3, (int) getpid(), span->thread);
+	}
+	fprintf(f, "]}\n");
+	fclose(f);
+}
+#endif
+
+#ifdef THREADS
+// Let the main loop take the lock between two slices if it is waiting for it. It may scroll the
+// viewport meanwhile: scroll back to the screen, which the parser addresses through it.
+static void yield_lock(void)
+{
+	if (!__atomic_load_n(&lock_waiters, __ATOMIC_SEQ_CST))
+		return;
+	UNLOCK();
+	while (__atomic_load_n(&lock_waiters, __ATOMIC_SEQ_CST))
+		sched_yield();
+	LOCK();
+	scroll(vt->term.lines - vt->term.scroll);
 }
 
-// Main loop: listen for X events and pty input, and periodically redraw the screen
-static void run(fd_set read_fds)
+// Parser thread of window `arg`: read and parse the pty output (the frame timer wakes up the main
+// loop to draw it), until the application exits or the window is closed
+static void* parse_loop(void *arg)
 {
-	clock_gettime(CLOCK_MONOTONIC, &monotime);
-	u64 old_time = monotime.tv_nsec;
+	select_view(arg); // the window is shared, but `view` and `vt` are per thread
+#ifdef TRACE
+	trace_thread = 1;
+#endif
+	for (;;) {
+		u64 read_start = TRACE_NOW();
+		long len = pty_fill();
+		u64 start = now();
+		LOCK();
+		if (len < 0 || view->closing) {
+			UNLOCK();
+			break;
+		}
+		TRACE_SPAN_UNTIL("read", read_start, start);
+		pty_start(len);
+		scroll(vt->term.lines - vt->term.scroll);
+		schedule_output(start);
+
+		while (vt->pty.c < vt->pty.end) {
+			const char *end = vt->pty.c + MIN(vt->pty.end - vt->pty.c, PARSE_SLICE);
+			while (vt->pty.c < end)
+				handle_input(*vt->pty.c++);
+			yield_lock();
+		}
+		view->frame.parse_time += now() - start;
+		pty_flush(); // replies to queries
+		if (view->frame.held && !vt->term.sync_until)
+			arm_timer(view->frame.deadline); // the update held back is complete: wake up the main loop
+		TRACE_SPAN("parse", start);
+		UNLOCK();
+	}
 
-	if (pselect(pty.fd + 1, &read_fds, 0, 0, &timeout, NULL) < 0)
-		die("select failed");
+	// Closing our end of `wake` tells the main loop that we stopped
+	close(vt->pty.wake[1]);
+	return NULL;
+}
+#endif
+
+// Call `handler` when `fd` becomes ready for `events`, with the current window selected. Watches are
+// edge-triggered: the handler has to drain `fd`, or remember that it is still readable.
+static void watch(int fd, u32 events, void (*handler)(u32))
+{
+	u32 i = 0;
+	while (i < LEN(loop.watches) && loop.watches[i].handler)
+		++i;
+	struct epoll_event event = { events | EPOLLET, { .u32 = i } };
+	if (i == LEN(loop.watches) || epoll_ctl(loop.fd, EPOLL_CTL_ADD, fd, &event))
+		die("Couldn't watch file descriptor");
+	loop.watches[i].handler = handler;
+	loop.watches[i].view = view;
+	loop.watches[i].fd = fd;
+}
 
-	clock_gettime(CLOCK_MONOTONIC, &monotime);
-	int64_t elapsed_time = monotime.tv_nsec - old_time;
+// Stop watching `fd`, and close it
+static void unwatch(int fd)
+{
+	for (u32 i = 0; i < LEN(loop.watches); ++i)
+		if (loop.watches[i].handler && loop.watches[i].fd == fd)
+			loop.watches[i].handler = NULL;
+	epoll_ctl(loop.fd, EPOLL_CTL_DEL, fd, NULL);
+	close(fd);
+}
 
+// Handle all the pending X events
+static void on_x_ready(u32 events)
+{
+	(void) events;
 	XEvent e;
-	while (XPending(w.disp) || !term.bot) {
+	while (XPending(w.disp)) {
+		XNextEvent(w.disp, &e);
+		if (!dispatch_event(&e))
+			continue;
+
+		// Show the effect right away, in every window if the event wasn't for one in particular
+		if (view) {
+			schedule(LATENCY);
+			continue;
+		}
+		for (View *v = views; v; v = v->next) {
+			select_view(v);
+			schedule(LATENCY);
+		}
+	}
+}
+
+// The frame timer expired: the main loop draws once it is done with the handlers
+static void on_timer(u32 events)
+{
+	(void) events;
+	u64 expirations;
+	if (read(view->timer, &expirations, sizeof(expirations))) {}
+}
+
+// SIGUSR1 was received: dump the performance counters (and the trace)
+static void on_signal(u32 events)
+{
+	(void) events;
+	struct signalfd_siginfo info;
+	while (read(loop.signals, &info, sizeof(info)) > 0) {
+		dump_stats();
+#ifdef TRACE
+		write_trace();
+#endif
+	}
+}
+
+#ifdef THREADS
+// The parser thread only writes to this pipe by closing it, when the application exited
+static void on_wake(u32 events)
+{
+	(void) events;
+	close_view(!vt->pty.end);
+}
+
+// The pty accepts output again: the main loop flushes it once it is done with the handlers
+static void on_pty_writable(u32 events)
+{
+	(void) events;
+}
+#else
+// The pty is read by the main loop, at its own pace (and written to once it is done with the handlers)
+static void on_pty_ready(u32 events)
+{
+	vt->pty.events |= events & (u32) ~EPOLLOUT;
+}
+
+// Read from the pty if it has anything left since it last became ready, without blocking
+static bool pty_poll(void)
+{
+	int avail = 0;
+	if (!(vt->pty.events & (EPOLLHUP | EPOLLERR)) && !ioctl(vt->pty.fd, FIONREAD, &avail) && !avail) {
+		vt->pty.events = 0;
+		return false;
+	}
+	long len = pty_fill();
+	if (len < 0) {
+		vt->pty.events = 0;
+		close_view(!vt->pty.end);
+		return false;
+	}
+	pty_start(len);
+	return true;
+}
+#endif
+
+// Open a window running `cmd` (or $SHELL) in directory `dir` (the current one if NULL)
+static void view_new(const char *dir, char *cmd[])
+{
+	View *v = calloc(1, sizeof(View));
+	if (!v)
+		die("Couldn't open a window");
+	v->vt = term_new(0, 0, 0, -1); // sized by fix_pty_size(), configured by configure_view()
+	v->next = views;
+	views = v;
+	select_view(v);
+
+	x_open_window();
+	pty_new(dir, cmd && *cmd ? cmd : (char*[]) { getenv("SHELL"), NULL });
+	startup.spawned = now();
+
+	if ((v->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+		die("Couldn't create the frame timer");
+	watch(v->timer, EPOLLIN, on_timer);
+#ifdef THREADS
+	if (pipe(vt->pty.wake) || pthread_create(&v->thread, NULL, parse_loop, v))
+		die("Couldn't start the parser thread");
+	fcntl(vt->pty.wake[0], F_SETFD, FD_CLOEXEC);
+	fcntl(vt->pty.wake[1], F_SETFD, FD_CLOEXEC);
+	watch(vt->pty.wake[0], EPOLLIN, on_wake);
+	watch(vt->pty.fd, EPOLLOUT, on_pty_writable);
+#else
+	watch(vt->pty.fd, EPOLLIN | EPOLLOUT, on_pty_ready);
+#endif
+
+	// Don't draw anything before the window manager gave the window its size
+	for (XEvent e; !v->vt->term.bot && !v->closed;) {
 		XNextEvent(w.disp, &e);
 		dispatch_event(&e);
 	}
+}
+
+// Free the window `v` closed by close_view(), and hang up its application
+static void view_free(View *v)
+{
+	select_view(v);
+#ifdef THREADS
+	// Stop the parser thread, unless it stopped already
+	LOCK();
+	v->closing = true;
+	UNLOCK();
+	unwatch(vt->pty.wake[0]);
+	pthread_join(v->thread, NULL);
+#endif
+	unwatch(v->timer);
+	unwatch(vt->pty.fd);
+	x_close_window();
+	term_free(vt);
+	free(v->frame.runes);
+	free(v->pasting.text);
+	free(v);
+	select_view(NULL);
+}
+
+// Parse the pending input of the selected window, flush its output, and draw it if a frame is due
+static void update_view(void)
+{
+	LOCK();
+#ifndef THREADS
+	if (vt->pty.c < vt->pty.end || vt->pty.events) {
+		u64 start = now();
+		scroll(vt->term.lines - vt->term.scroll);
+
+		if (vt->pty.c == vt->pty.end && pty_poll())
+			schedule_output(start);
+
+		// Parse in slices, and leave the rest for the next iteration if X input is pending
+		// (so that Ctrl-C works during a flood) or if a frame is due
+		while (vt->pty.c < vt->pty.end) {
+			const char *end = vt->pty.c + MIN(vt->pty.end - vt->pty.c, PARSE_SLICE);
+			while (vt->pty.c < end)
+				handle_input(*vt->pty.c++);
+			if (XEventsQueued(w.disp, QueuedAfterReading) || now() >= view->frame.deadline)
+				break;
+		}
+		view->frame.parse_time += now() - start;
+		TRACE_SPAN("parse", start);
+	}
+#endif
+
+	// Send everything queued while handling events and parsing in one go
+	paste_feed();
+	pty_flush();
+	u64 time = now();
+	bool due = view->frame.mode != IDLE && time >= view->frame.deadline;
+	if (due && time < vt->term.sync_until) {
+		// Don't show a partial update: wait for its end (or for the timeout)
+		view->frame.held = true;
+		arm_timer(vt->term.sync_until);
+		due = false;
+	}
+	UNLOCK();
+	if (due)
+		draw_frame();
+}
+
+// Main loop: wait for X events, pty input or the frame timers, and redraw the windows whose frame
+// is due. Never wakes up while idle.
+static void run(void)
+{
+	LOCK();
+	// Don't wait if there is input we didn't get to yet
+	bool busy = XEventsQueued(w.disp, QueuedAlready);
+	for (View *v = views; v; v = v->next) {
+		busy = busy || (v->pasting.pos < v->pasting.len && !v->vt->out.len);
+#ifndef THREADS
+		busy = busy || v->vt->pty.c < v->vt->pty.end || v->vt->pty.events; // (with THREADS, that's the parser's business)
+#endif
+	}
+	UNLOCK();
+
+	struct epoll_event events[8];
+	u64 wait_start = now();
+	int n = epoll_wait(loop.fd, events, LEN(events), busy ? 0 : -1);
+	if (n < 0 && errno != EINTR)
+		die("epoll_wait failed");
+	perf.wait_time += now() - wait_start;
+	TRACE_SPAN("wait", wait_start);
+
+	LOCK();
+	u64 events_start = TRACE_NOW();
+	for (int i = 0; i < n; ++i) {
+		__typeof(*loop.watches) *watched = &loop.watches[events[i].data.u32];
+		if (watched->handler && !(watched->view && watched->view->closed)) {
+			select_view(watched->view);
+			watched->handler(events[i].events);
+		}
+	}
+	if (XEventsQueued(w.disp, QueuedAlready))
+		on_x_ready(0);
+	TRACE_SPAN("events", events_start);
+	UNLOCK();
+
+	for (View *v = views; v; v = v->next) {
+		if (v->closed)
+			continue;
+		select_view(v);
+		update_view();
+	}
+
+	// Free the windows closed meanwhile, and exit with the last one (unless in server mode)
+	for (View **v = &views; *v;) {
+		View *closed = *v;
+		if (!closed->closed) {
+			v = &closed->next;
+			continue;
+		}
+		*v = closed->next;
+		int status = closed->status;
+		view_free(closed);
+		if (!views && !w.serving)
+			exit(status);
+	}
+}
+
+// Path of the socket of the server for the current display, in $XDG_RUNTIME_DIR. Fails unless that
+// is a private directory: elsewhere, other users could connect to the server or take its place.
+static bool server_address(struct sockaddr_un *addr)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	const char *display = getenv("DISPLAY");
+	struct stat info;
+	if (!dir || stat(dir, &info) || !S_ISDIR(info.st_mode) || info.st_uid != getuid() || (info.st_mode & 077))
+		return false;
+
+	*addr = (struct sockaddr_un) { .sun_family = AF_UNIX };
+	int len = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/vvvvvt%s", dir, display ? display : "");
+	return len > 0 && len < (int) sizeof(addr->sun_path);
+}
+
+// Connect to the server at `addr`. Returns the socket, or -1 if there is no server running.
+static int connect_server(const struct sockaddr_un *addr)
+{
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd >= 0 && connect(fd, (const struct sockaddr*) addr, sizeof(*addr))) {
+		int error = errno;
+		close(fd);
+		errno = error;
+		return -1;
+	}
+	return fd;
+}
+
+// Ask the server to open a terminal running `cmd` in the current directory.
+// Returns false if there is no server running.
+static bool client_request(char *cmd[])
+{
+	struct sockaddr_un addr;
+	int fd = server_address(&addr) ? connect_server(&addr) : -1;
+	if (fd < 0)
+		return false;
+
+	// The request is the working directory, then the command, as NUL-terminated strings
+	char cwd[PATH_MAX];
+	if (!getcwd(cwd, sizeof(cwd)))
+		strcpy(cwd, "/");
+	FILE *request = fdopen(fd, "w");
+	fwrite(cwd, 1, strlen(cwd) + 1, request);
+	for (; *cmd; ++cmd)
+		fwrite(*cmd, 1, strlen(*cmd) + 1, request);
+	return !fclose(request);
+}
+
+// Read what the current client sent so far with client_request(), without blocking. Once it closed
+// the connection, open the window it asks for and return true.
+static bool read_request(void)
+{
+	char buf[BUFSIZ];
+	long n;
+	while ((n = read(loop.client, buf, sizeof(buf))) > 0)
+		fwrite(buf, 1, (size_t) n, loop.request);
+	if (n < 0 && errno == EAGAIN)
+		return false;
+
+	unwatch(loop.client);
+	loop.client = -1;
+	fclose(loop.request);
+	char *data = loop.request_data;
+	size_t len = n ? 0 : loop.request_len; // drop the request on errors
+
+	// The request is the working directory, then the command, as NUL-terminated strings
+	if (len) {
+		char **args = calloc(len + 1, sizeof(*args)); // at most one string per byte
+		if (!args)
+			die("Couldn't read the request");
+		int argc = 0;
+		for (char *arg = data; arg < data + len; arg += strlen(arg) + 1)
+			args[argc++] = arg;
+		view_new(args[0], args + 1);
+		free(args);
+		select_view(NULL);
+	}
+	free(data);
+	return true;
+}
+
+// A client connected to the server, or sent more of its request. Requests are read one at a time:
+// the next clients wait in the queue of the socket. Only the clients running as our user are served.
+static void on_client(u32 events)
+{
+	(void) events;
+	while (loop.client < 0 || read_request()) {
+		int conn = accept(loop.server, NULL, NULL);
+		if (conn < 0)
+			return;
+		struct ucred peer;
+		socklen_t len = sizeof(peer);
+		if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &peer, &len) || peer.uid != getuid()) {
+			close(conn);
+			continue;
+		}
+
+		startup.start = startup.connected = now();
+		startup.fonts = 0;
+		if (!(loop.request = open_memstream(&loop.request_data, &loop.request_len)))
+			die("Couldn't read the request");
+		fcntl(conn, F_SETFL, O_NONBLOCK);
+		fcntl(conn, F_SETFD, FD_CLOEXEC);
+		loop.client = conn;
+		watch(conn, EPOLLIN, on_client);
+	}
+}
+
+// Server mode: open a window for each client, in this process. They all share the X connection,
+// the fonts and the glyph cache, so new windows open faster and the fonts are loaded only once.
+static void serve(void)
+{
+	struct sockaddr_un addr;
+	if (!server_address(&addr)) {
+		fprintf(stderr, "Server mode needs $XDG_RUNTIME_DIR to be a private directory\n");
+		exit(1);
+	}
 
-	if (FD_ISSET(pty.fd, &read_fds)) {
-		scroll(term.lines - term.scroll);
-		handle_input(pty_getchar());
-		while (pty.c < pty.end)
-			handle_input(*pty.c++);
+	// Only replace a socket that no server listens to anymore
+	int fd = connect_server(&addr);
+	if (fd >= 0) {
+		fprintf(stderr, "A server is already running on %s\n", addr.sun_path);
+		exit(1);
 	}
+	struct stat info;
+	if (errno == ECONNREFUSED && !lstat(addr.sun_path, &info) && S_ISSOCK(info.st_mode))
+		unlink(addr.sun_path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || bind(fd, (struct sockaddr*) &addr, sizeof(addr))
+			|| listen(fd, 16))
+		die("Couldn't start the server");
+	fcntl(fd, F_SETFL, O_NONBLOCK); // accept() until there are no clients left
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	loop.server = fd;
+	loop.client = -1;
+	w.serving = true;
+	watch(fd, EPOLLIN, on_client);
+}
+
+#ifdef BENCH
+// Parse `data` repeatedly, and report the throughput as one JSON object per line
+static void bench(const char *name, char *data, size_t len)
+{
+	struct timespec start, end;
+	long passes = 0;
+	double ns;
+
+	// Replies to queries would normally go to the pty: drop them
+	Terminal *t = term_new(24, 80, 2048, -1);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	// Replay the workload for at least a quarter of a second
+	do {
+		term_feed(t, data, (long) len);
+		++passes;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		ns = (double) (end.tv_sec - start.tv_sec) * 1e9 + (double) (end.tv_nsec - start.tv_nsec);
+	} while (ns < 2.5e8);
+
+	double bytes = (double) len * (double) passes;
+
+	printf("{\"workload\": \"%s\", \"bytes\": %zu, \"passes\": %ld, "
+			"\"mb_per_s\": %.2f, \"ns_per_byte\": %.3f, \"cells\": %llu}\n",
+			name, len, passes, bytes / ns * 1e3, ns / bytes, (unsigned long long) t->stats.cells);
+	term_free(t);
+	free(data);
+}
 
-	timeout.tv_nsec = MIN(timeout.tv_nsec - elapsed_time, 1668000);
-	if (timeout.tv_nsec <= 0) {
-		draw();
-		timeout.tv_nsec = 999999999;
+// Replay synthetic workloads and the files given as arguments straight into the parser
+static int bench_main(int argc, char *argv[])
+{
+	char *data;
+	size_t len;
+	FILE *f;
+
+	// `seq 200000`
+	f = open_memstream(&data, &len);
+	for (int i = 1; i <= 200000; ++i)
+		fprintf(f, "%d\r\n", i);
+	fclose(f);
+	bench("seq", data, len);
+
+	// `ls --color`: short SGR-delimited runs
+	f = open_memstream(&data, &len);
+	for (int i = 0; i < 20000; ++i)
+		fprintf(f, "\033[0m\033[01;34mdir%d\033[0m  \033[01;32mrun%d.sh\033[0m  file%d.c  "
+				"\033[38;5;%dmlog%d.txt\033[0m  \033[40;33;01mdev%d\033[0m\r\n", i, i, i, i % 256, i, i);
+	fclose(f);
+	bench("ls-color", data, len);
+
+	// Mostly non-ASCII text
+	f = open_memstream(&data, &len);
+	for (int i = 0; i < 20000; ++i)
+		fprintf(f, "%d Съешь же ещё этих мягких булок — λx.λy.x ≠ ∅ — 日本語のテキスト ✓ ¿Qué?\r\n", i);
+	fclose(f);
+	bench("utf-8", data, len);
+
+	// Vim-style scrolling inside a region, with a status line
+	f = open_memstream(&data, &len);
+	for (int i = 0; i < 20000; ++i)
+		fprintf(f, "\033[2;23r\033[%s\033[%dH\033[K\033[33m%5d \033[m\033[1mint\033[m line_%d = %d;"
+				"\033[r\033[24H\033[7m-- INSERT --\033[m\033[K %d,1",
+				i % 3 ? "23H\n" : "2H\033M", i % 3 ? 23 : 2, i, i, i * 7, i);
+	fclose(f);
+	bench("vim-scroll", data, len);
+
+	// Recorded byte streams, such as the files in tests/
+	for (int i = 1; i < argc; ++i) {
+		if (!(f = fopen(argv[i], "r")))
+			die(argv[i]);
+		fseek(f, 0, SEEK_END);
+		len = (size_t) ftell(f);
+		rewind(f);
+		data = malloc(MAX(len, 1));
+		len = fread(data, 1, len, f);
+		fclose(f);
+		bench(argv[i], data, len);
 	}
+
+	return 0;
 }
+#endif
 
 // Parse arguents, initialize everything, call the main loop
 int main(int argc, char *argv[])
 {
-#ifdef HEADLESS
+#if defined(BENCH)
+	return bench_main(argc, argv);
+#elif defined(HEADLESS)
 	(void) argc, (void) argv;
-	pty.rows = 24;
-	pty.cols = 80;
 	while (__AFL_LOOP(1000)) {
-		pty.c = pty.end = 0;
-		handle_esc('c');
-		handle_input(pty_getchar());
-		while (pty.c < pty.end)
-			handle_input(*pty.c++);
+		Terminal *t = term_new(24, 80, 2048, 1);
+		char buf[BUFSIZ];
+		long len;
+		while ((len = read(0, buf, sizeof(buf))) > 0)
+			term_feed(t, buf, len);
+
+		// Whatever state the input left the terminal in, shrinking or growing it and reading
+		// back every cell (history included) must stay within bounds
+		term_resize(t, 10, 132);
+		for (int y = -2048; y < 10; ++y)
+			for (int x = 0; x < 132; ++x)
+				(void) term_cell(t, x, y);
+		term_free(t);
 	}
 #else
-	x_init();
-	pty_new(argc > 1 ? argv + 1 : (char*[]) { getenv("SHELL"), NULL });
+	startup.start = now();
+	char **cmd = argc > 1 ? argv + 1 : NULL;
+	bool server = cmd && !strcmp(*cmd, "--daemon");
+	if (cmd && !strcmp(*cmd, "--client") && client_request(++cmd))
+		return 0;
 
-	fd_set read_fds;
-	FD_ZERO(&read_fds);
-	FD_SET(XConnectionNumber(w.disp), &read_fds);
-	FD_SET(pty.fd, &read_fds);
+	x_init();
+	if ((loop.fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		die("Couldn't create the event loop");
+	watch(XConnectionNumber(w.disp), EPOLLIN, on_x_ready);
+
+	// Receive SIGUSR1 through the event loop (it is blocked before starting any parser thread,
+	// so that it never lands there)
+	sigset_t usr1;
+	sigemptyset(&usr1);
+	sigaddset(&usr1, SIGUSR1);
+	if (sigprocmask(SIG_BLOCK, &usr1, NULL) || (loop.signals = signalfd(-1, &usr1, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+		die("Couldn't receive SIGUSR1");
+	watch(loop.signals, EPOLLIN, on_signal);
+
+	LOCK();
+	if (server)
+		serve();
+	else
+		view_new(NULL, cmd);
+	UNLOCK();
 
 	for (;;)
-		run(read_fds);
+		run();
 #endif
 }